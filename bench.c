@@ -0,0 +1,390 @@
+/*
+ * Microbenchmarks for tt.
+ *
+ * Times the command parser and the receive path stages one at a time
+ * over synthetic input, to catch regressions in the hot functions
+ * before they show up in a real session.  tt.c is included directly
+ * so the static functions can be called; everything tt would print
+ * goes to /dev/null and the results go to the original stdout.
+ *
+ * Build and run with "make microbench".
+ */
+
+#define main tt_main
+#include "tt.c"
+#undef main
+
+#include <math.h>
+
+#define BENCH_REPS	11		/* repetitions per case */
+#define BENCH_TARGET_NS	20000000LL	/* wanted length of a repetition */
+#define BENCH_CHUNK_MAX	4096
+
+struct bench
+{
+    const char *stage;
+    const char *name;
+    const char *unit;
+    void (*setup)(void);	/* run before each repetition, not timed */
+    long (*run)(long iters);	/* returns the number of units done */
+};
+
+static FILE *bench_out;
+static char bench_chunk[BENCH_CHUNK_MAX];
+static int bench_chunk_len;
+static char *bench_log_name;
+
+static long long bench_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static unsigned long bench_random(void)
+{
+    static unsigned long x = 88172645463325252UL;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return x;
+}
+
+/************************************************************************/
+
+/* Synthetic input: what a console usually sends, raw binary data, and
+   a line that has stopped moving */
+
+enum { DIST_TEXT, DIST_BINARY, DIST_ZERO };
+
+static const char *dist_names[] = { "text", "binary", "zero" };
+
+static void bench_fill(int dist, int n)
+{
+    static const char words[] = "booting kernel mounting root eth0 link up "
+	"login: 0x1f3a ok [   12.345678] usb 1-1: new device ";
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+	if (dist == DIST_TEXT)
+	    bench_chunk[i] = i % 48 == 47 ? '\n'
+		: words[bench_random() % (sizeof(words) - 1)];
+	else if (dist == DIST_BINARY)
+	    bench_chunk[i] = bench_random();
+	else
+	    bench_chunk[i] = 0;
+    }
+    bench_chunk_len = n;
+}
+
+/************************************************************************/
+
+/* fuzzy() against every command name, the way handle() calls it */
+
+static const char *fuzzy_inputs[] =
+{
+    "set speed 115200",
+    "s sp 115200",
+    "connect",
+    "set framing hdlc",
+    "log sync interval 100",
+    "frobnicate",
+};
+
+#define NUM_FUZZY_INPUTS	(sizeof(fuzzy_inputs) / sizeof(fuzzy_inputs[0]))
+
+static long run_fuzzy(long iters)
+{
+    struct command *cmd;
+    char input[64];
+    char *args;
+    long calls = 0;
+    long i;
+    int k;
+
+    for (i = 0; i < iters; i++)
+    {
+	for (k = 0; k < NUM_FUZZY_INPUTS; k++)
+	{
+	    strcpy(input, fuzzy_inputs[k]);
+	    for (cmd = commands; cmd->name; cmd++)
+	    {
+		if (fuzzy(cmd->name, input, &args))
+		    args = NULL;
+		calls++;
+	    }
+	}
+    }
+    return calls;
+}
+
+/* handle() with commands that only change settings */
+
+static const char *handle_inputs[] =
+{
+    "set timestamp off",
+    "set nlcr off",
+    "set pacing off",
+    "set framing none",
+    "set monitor off",
+    "s t off",
+    "frobnicate",
+};
+
+#define NUM_HANDLE_INPUTS	(sizeof(handle_inputs) / sizeof(handle_inputs[0]))
+
+static long run_handle(long iters)
+{
+    char input[64];
+    long i;
+    int k;
+
+    for (i = 0; i < iters; i++)
+    {
+	for (k = 0; k < NUM_HANDLE_INPUTS; k++)
+	{
+	    strcpy(input, handle_inputs[k]);
+	    handle(input);
+	}
+    }
+    return iters * NUM_HANDLE_INPUTS;
+}
+
+/************************************************************************/
+
+/* The receive path stages, on the current chunk */
+
+static long run_hex(long iters)
+{
+    long i;
+
+    for (i = 0; i < iters; i++)
+	rx_hex(bench_chunk, bench_chunk_len);
+    return iters * bench_chunk_len;
+}
+
+static long run_log(long iters)
+{
+    long i;
+
+    for (i = 0; i < iters; i++)
+	log_data(bench_chunk, bench_chunk_len);
+    return iters * bench_chunk_len;
+}
+
+static long run_crc32(long iters)
+{
+    long i;
+
+    for (i = 0; i < iters; i++)
+	cap_crc32 = crc_update(crc32_table, cap_crc32,
+			       (const unsigned char *)bench_chunk, bench_chunk_len);
+    return iters * bench_chunk_len;
+}
+
+#ifdef HAVE_CRC32C_HW
+static long run_crc32c_hw(long iters)
+{
+    long i;
+
+    for (i = 0; i < iters; i++)
+	cap_crc32c = crc32c_hw(cap_crc32c, (const unsigned char *)bench_chunk,
+			       bench_chunk_len);
+    return iters * bench_chunk_len;
+}
+#endif
+
+static long run_xlat(long iters)
+{
+    static char out[BENCH_CHUNK_MAX * XLAT_OUT];
+    long i;
+
+    for (i = 0; i < iters; i++)
+	xlat_copy(&xlat_rx, bench_chunk, bench_chunk_len, out);
+    return iters * bench_chunk_len;
+}
+
+static long run_clean(long iters)
+{
+    long i;
+
+    for (i = 0; i < iters; i++)
+	clean_data(bench_chunk, bench_chunk_len);
+    return iters * bench_chunk_len;
+}
+
+static void setup_log(void)
+{
+    if (!log_ring)
+    {
+	ftruncate(log_fd, 0);
+	lseek(log_fd, 0, SEEK_SET);
+	log_pos = log_alloc = 0;
+    }
+    log_bol = 1;
+}
+
+static void log_open_bench(int ring)
+{
+    log_fd = open(bench_log_name, O_CREAT | O_TRUNC | O_RDWR, 0600);
+    if (log_fd == -1 || (ring && (log_ring = ring_open(log_fd, 16 << 20)) == NULL))
+    {
+	perror(bench_log_name);
+	exit(1);
+    }
+}
+
+static void log_close_bench(void)
+{
+    log_close();
+    unlink(bench_log_name);
+}
+
+/************************************************************************/
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Run a case and report the median, the minimum and the median
+   absolute deviation over the repetitions */
+static void bench_run(struct bench *b)
+{
+    double per_unit[BENCH_REPS], dev[BENCH_REPS];
+    long long t;
+    long iters, units;
+    double median;
+    int r;
+
+    /* calibrate the number of iterations per repetition */
+    for (iters = 1; ; iters *= 2)
+    {
+	if (b->setup)
+	    b->setup();
+	t = bench_ns();
+	b->run(iters);
+	t = bench_ns() - t;
+	if (t > BENCH_TARGET_NS / 8)
+	    break;
+    }
+    iters = iters * (double)BENCH_TARGET_NS / t + 1;
+
+    for (r = 0; r < BENCH_REPS; r++)
+    {
+	if (b->setup)
+	    b->setup();
+	t = bench_ns();
+	units = b->run(iters);
+	t = bench_ns() - t;
+	per_unit[r] = (double)t / units;
+    }
+
+    qsort(per_unit, BENCH_REPS, sizeof(double), cmp_double);
+    median = per_unit[BENCH_REPS / 2];
+    for (r = 0; r < BENCH_REPS; r++)
+	dev[r] = fabs(per_unit[r] - median);
+    qsort(dev, BENCH_REPS, sizeof(double), cmp_double);
+
+    fprintf(bench_out, "%-8s %-24s %10.2f %10.2f %7.1f%%  ns/%s\n",
+	    b->stage, b->name, median, per_unit[0],
+	    100 * dev[BENCH_REPS / 2] / median, b->unit);
+    fflush(bench_out);
+}
+
+static void bench_data(const char *stage, const char *variant,
+		       long (*run)(long), void (*setup)(void))
+{
+    static const int sizes[] = { 1, 16, 256, 4096 };
+    struct bench b = { stage, NULL, "byte", setup, run };
+    char name[64];
+    int d, i;
+
+    for (d = DIST_TEXT; d <= DIST_ZERO; d++)
+    {
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+	{
+	    bench_fill(d, sizes[i]);
+	    snprintf(name, sizeof(name), "%s%s/%d", variant, dist_names[d],
+		     sizes[i]);
+	    b.name = name;
+	    bench_run(&b);
+	}
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    struct bench b;
+    char rules[64];
+    const char *tmp;
+    int fd;
+
+    term_fd = -1;
+    log_fd = -1;
+
+    /* keep the results, send everything tt prints to /dev/null */
+    if ((fd = dup(1)) == -1 || (bench_out = fdopen(fd, "w")) == NULL)
+    {
+	perror("stdout");
+	return 1;
+    }
+    if ((fd = open("/dev/null", O_WRONLY)) == -1)
+    {
+	perror("/dev/null");
+	return 1;
+    }
+    dup2(fd, 1);
+    dup2(fd, 2);
+    close(fd);
+
+    tmp = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    bench_log_name = malloc(strlen(tmp) + 32);
+    sprintf(bench_log_name, "%s/tt-bench.%d", tmp, (int)getpid());
+
+    fprintf(bench_out, "%-8s %-24s %10s %10s %8s\n",
+	    "stage", "case", "median", "min", "mad");
+
+    b = (struct bench){ "fuzzy", "commands[] x inputs", "call", NULL, run_fuzzy };
+    bench_run(&b);
+    b = (struct bench){ "handle", "settings", "cmd", NULL, run_handle };
+    bench_run(&b);
+
+    bench_data("hex", "", run_hex, NULL);
+
+    xlat_set(&xlat_rx, strcpy(rules, "\\r="));
+    bench_data("xlat", "cr/", run_xlat, NULL);
+    xlat_set(&xlat_rx, strcpy(rules, "strip \\r= \\n=\\r\\n"));
+    bench_data("xlat", "strip-crlf/", run_xlat, NULL);
+    xlat_set(&xlat_rx, strcpy(rules, "a=b b=c c=d d=e e=f"));
+    bench_data("xlat", "table/", run_xlat, NULL);
+
+    crc_init(crc32_table, 0xedb88320);
+    bench_data("crc", "crc32/", run_crc32, NULL);
+#ifdef HAVE_CRC32C_HW
+    if (__builtin_cpu_supports("sse4.2"))
+	bench_data("crc", "crc32c-hw/", run_crc32c_hw, NULL);
+#endif
+
+    log_open_bench(0);
+    bench_data("log", "", run_log, setup_log);
+    flag_timestamp = 1;
+    bench_data("log", "ts/", run_log, setup_log);
+    flag_timestamp = 0;
+    log_close_bench();
+
+    log_open_bench(1);
+    bench_data("log", "ring/", run_log, setup_log);
+    log_close_bench();
+
+    clean_fd = open("/dev/null", O_WRONLY);
+    bench_data("clean", "", run_clean, NULL);
+    clean_close();
+
+    return 0;
+}
@@ -0,0 +1,89 @@
+/*
+ * Checks for tt.
+ *
+ * Feeds known input to the receive path stages and compares what tt
+ * would show with what is expected.  tt.c is included directly so the
+ * static functions can be called; what tt prints is caught in a
+ * temporary file and the results go to the original stdout.
+ *
+ * Build and run with "make check".
+ */
+
+#define main tt_main
+#include "tt.c"
+#undef main
+
+static FILE *check_out;
+static int check_failed;
+
+/* Run data through the framing decoder and return what it showed */
+static const char *check_frame_rx(const char *name, const void *data, int n)
+{
+    static char out[4096];
+    const struct framing *f;
+    FILE *fp;
+    size_t k;
+
+    for (f = framings; strcmp(f->name, name) != 0; f++)
+	;
+    set_framing(f);
+    frame_bol = 1;
+
+    fflush(stdout);
+    fp = tmpfile();
+    dup2(fileno(fp), 1);
+    frame_rx(data, n);
+    rewind(fp);
+    k = fread(out, 1, sizeof(out) - 1, fp);
+    out[k] = '\0';
+    fclose(fp);
+    return out;
+}
+
+static void check_frames(const char *what, const char *name,
+			 const void *data, int n, const char *want)
+{
+    const char *got = check_frame_rx(name, data, n);
+
+    if (strcmp(got, want) == 0)
+    {
+	fprintf(check_out, "ok      %s\n", what);
+	return;
+    }
+    fprintf(check_out, "FAILED  %s\n  want: %s\n  got:  %s\n", what, want, got);
+    check_failed = 1;
+}
+
+int main(int argc, char *argv[])
+{
+    static const unsigned char cobs[] =
+	"\x00\x03\x11\x22\x02\x33\x00\x02\x44\x00text again\r\n";
+    /* two frames sharing a flag, text, then back to back flags */
+    static const unsigned char hdlc[] =
+	"boot\n\x7e\xff\x03\x01\xde\x3b\x7e\xff\x03\x02\x45\x09\x7e"
+	"after text\r\n\x7e\xff\x03\x03\xcc\x18\x7e\x7e\xff\x03\x04\x73\x6c\x7e"
+	"tail\r\n";
+    static const unsigned char slip[] =
+	"hello\r\n\xc0\x01\x02\xdb\xdc\x03\xc0world\r\n";
+    int fd;
+
+    term_fd = -1;
+    log_fd = -1;
+
+    if ((fd = dup(1)) == -1 || (check_out = fdopen(fd, "w")) == NULL)
+    {
+	perror("stdout");
+	return 1;
+    }
+
+    check_frames("cobs text after frames", "cobs", cobs, sizeof(cobs) - 1,
+		 "[cobs 4: 11 22 00 33]\r\n[cobs 1: 44]\r\ntext again\r\n");
+    check_frames("hdlc text between frames", "hdlc", hdlc, sizeof(hdlc) - 1,
+		 "boot\n[hdlc 3: ff 03 01]\r\n[hdlc 3: ff 03 02]\r\n"
+		 "after text\r\n[hdlc 3: ff 03 03]\r\n[hdlc 3: ff 03 04]\r\n"
+		 "tail\r\n");
+    check_frames("slip text around a frame", "slip", slip, sizeof(slip) - 1,
+		 "hello\r\n[slip 4: 01 02 c0 03]\r\nworld\r\n");
+
+    return check_failed;
+}
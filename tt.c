@@ -3,13 +3,21 @@
    This software is licensed under the MIT License.
 */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 #include <limits.h>
 #include <errno.h>
 #include <getopt.h>
+#include <glob.h>
 #include <ctype.h>
+#include <regex.h>
+#include <time.h>
+#include <poll.h>
 
 #include <signal.h>
 #include <unistd.h>
@@ -21,6 +29,24 @@
 #include <sys/file.h>
 #include <sys/ioctl.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/inotify.h>
+#include <sys/timerfd.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <linux/serial.h>
+#include <linux/io_uring.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define HAVE_CRC32C_HW
+#endif
 
 /************************************************************************/
 
@@ -56,6 +82,15 @@ static struct speed speedtab[] =
 #endif
 #ifdef	B115200
     { 115200, B115200 },
+#endif
+#ifdef	B230400
+    { 230400, B230400 },
+#endif
+#ifdef	B460800
+    { 460800, B460800 },
+#endif
+#ifdef	B921600
+    { 921600, B921600 },
 #endif
     { 0, B0 },
     { -1, -1 }
@@ -96,6 +131,11 @@ static int escape_char = 28;		/* Ctrl-\ */
 static int break_duration = 5;		/* break is 0.5 seconds long */
 static int flag_nlcr = 0;	/* Translate NL to CRNL */
 static int flag_hex = 0; 	/* Show hex */
+static int flag_timestamp = 0;	/* Timestamp lines in the log */
+static long pace_char_us = 0;	/* Delay after each character */
+static long pace_line_ms = 0;	/* Delay after each line */
+static int flag_monitor = 0;	/* Report modem status changes */
+static int session_mode = 0;	/* Running as a background session */
 
 /************************************************************************/
 
@@ -103,6 +143,9 @@ static void setup_tty(void)
 {
     struct termios termios;
 
+    if (session_mode)
+	return;
+
     if (tcgetattr(0, &stdin_termios) == -1)
     {
 	perror("tcgetattr stdin");
@@ -137,6 +180,9 @@ static void setup_tty(void)
 
 static void restore_tty(void)
 {
+    if (session_mode)
+	return;
+
     if (tcsetattr(0, TCSANOW, &stdin_termios) == -1)
     {
 	perror("tcsetattr stdin");
@@ -150,6 +196,8 @@ static void restore_tty(void)
     }
 }
 
+static void rs485_apply(int fd);
+
 static int setup_term(int fd)
 {
     struct termios termios;
@@ -174,9 +222,517 @@ static int setup_term(int fd)
 	return -1;
     }
 
+    rs485_apply(fd);
+    return 0;
+}
+
+/************************************************************************/
+
+/* Handle \r, \n, \t and \xNN escapes in place, returns the new length */
+static int unescape(char *s)
+{
+    char *p = s, *q = s;
+    char *end;
+
+    while (*p)
+    {
+	if (*p != '\\' || !p[1])
+	{
+	    *q++ = *p++;
+	    continue;
+	}
+	switch (*++p)
+	{
+	case 'r': *q++ = '\r'; p++; break;
+	case 'n': *q++ = '\n'; p++; break;
+	case 't': *q++ = '\t'; p++; break;
+	case 'x':
+	    *q++ = strtol(p + 1, &end, 16);
+	    p = end;
+	    break;
+	default: *q++ = *p++; break;
+	}
+    }
+
+    return q - s;
+}
+
+/* Parse a size with an optional k, m or g suffix.  A size that does
+   not fit leaves *end at the start, so that callers reject it. */
+static unsigned long parse_size(const char *s, char **end)
+{
+    unsigned long n;
+    int shift = 0;
+
+    errno = 0;
+    n = strtoul(s, end, 10);
+
+    switch (tolower(**end))
+    {
+    case 'g': shift += 10;	/* fall through */
+    case 'm': shift += 10;	/* fall through */
+    case 'k': shift += 10; ++*end;
+    }
+    if (errno == ERANGE || n > ULONG_MAX >> shift)
+    {
+	*end = (char *)s;
+	return 0;
+    }
+    return n << shift;
+}
+
+static long long now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void sleep_until_us(long long t)
+{
+    struct timespec ts;
+
+    ts.tv_sec = t / 1000000;
+    ts.tv_nsec = t % 1000000 * 1000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+	;
+}
+
+static int write_all(int fd, const void *buf, int n)
+{
+    const char *p = buf;
+    int r;
+
+    while (n > 0)
+    {
+	if ((r = write(fd, p, n)) < 0)
+	{
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	p += r;
+	n -= r;
+    }
+
+    return 0;
+}
+
+static int open_pty(int *slave_fd)
+{
+    struct termios termios;
+    int fd;
+
+    if ((fd = posix_openpt(O_RDWR | O_NOCTTY)) == -1 ||
+	grantpt(fd) == -1 || unlockpt(fd) == -1)
+    {
+	perror("posix_openpt");
+	return -1;
+    }
+
+    /* keep the slave open so that the pty stays usable when a
+       client closes it, and make it raw */
+    if ((*slave_fd = open(ptsname(fd), O_RDWR | O_NOCTTY)) == -1 ||
+	tcgetattr(*slave_fd, &termios) == -1)
+    {
+	perror(ptsname(fd));
+	close(fd);
+	return -1;
+    }
+    cfmakeraw(&termios);
+    tcsetattr(*slave_fd, TCSANOW, &termios);
+
+    return fd;
+}
+
+/************************************************************************/
+
+/* Everything shown to the user while connected goes through
+   out_write(), which also keeps it in the scrollback and passes it on
+   to clients attached to a session.  The scrollback maps the same pages
+   twice in a row, so the last hist_size bytes are always contiguous and
+   can be searched with memmem() and regexec() without caring where the
+   ring wraps. */
+
+#define SCROLLBACK_SIZE	(1024 * 1024)
+#define HISTORY_REPLAY	65536		/* sent to clients that attach */
+
+static char *hist_buf;
+static size_t hist_size = SCROLLBACK_SIZE;
+static size_t hist_mapped;		/* size of hist_buf */
+static unsigned long long hist_head;	/* total number of bytes */
+
+static void ctl_output(const void *buf, int n);
+static void pty_output(const char *buf, int n);
+
+/* (Re)allocate the scrollback, keeping as much of its contents as fit */
+static int hist_alloc(size_t size)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    size_t keep;
+    char *buf = NULL;
+    int fd;
+
+    size = (size + page - 1) / page * page;
+    if (size == hist_mapped)
+	return 0;
+
+    if (size)
+    {
+	if ((fd = memfd_create("tt-scrollback", 0)) == -1)
+	    return -1;
+	if (ftruncate(fd, size) == -1
+	    || (buf = mmap(NULL, 2 * size, PROT_NONE,
+			   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED
+	    || mmap(buf, size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED
+	    || mmap(buf + size, size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)
+	{
+	    if (buf && buf != MAP_FAILED)
+		munmap(buf, 2 * size);
+	    close(fd);
+	    return -1;
+	}
+	close(fd);
+
+	keep = hist_head < hist_mapped ? hist_head : hist_mapped;
+	if (keep > size)
+	    keep = size;
+	if (keep)
+	    memcpy(buf + (hist_head - keep) % size,
+		   hist_buf + (hist_head - keep) % hist_mapped, keep);
+    }
+
+    if (hist_buf)
+	munmap(hist_buf, 2 * hist_mapped);
+    hist_buf = buf;
+    hist_mapped = size;
     return 0;
 }
 
+/* Return the scrollback as one block */
+static char *hist_data(size_t *len)
+{
+    *len = hist_head < hist_mapped ? hist_head : hist_mapped;
+    return hist_buf + (hist_head - *len) % (hist_mapped ? hist_mapped : 1);
+}
+
+static void hist_put(const char *buf, int n)
+{
+    if (!hist_buf)
+	return;
+
+    if ((size_t) n > hist_mapped)
+    {
+	hist_head += n - hist_mapped;
+	buf += n - hist_mapped;
+	n = hist_mapped;
+    }
+
+    memcpy(hist_buf + hist_head % hist_mapped, buf, n);
+    hist_head += n;
+}
+
+static int out_write(const void *buf, int n)
+{
+    hist_put(buf, n);
+    ctl_output(buf, n);
+
+    if (session_mode)
+	return 0;
+    return write_all(1, buf, n);
+}
+
+/************************************************************************/
+
+/* Framing decoders for binary protocols sharing the console.  Each
+   decoder maps every received byte to a character class, and a
+   transition table maps (state, class) to an action and the next
+   state.  Bytes outside of a frame are passed through as text,
+   complete frames are shown as a length and a hex summary.  HDLC
+   frames may share a flag and COBS frames only have a trailing
+   delimiter, so with these a frame end is followed by FS_NEXT, where
+   a byte that can lead a frame starts one and anything else is text. */
+
+enum { FS_TEXT, FS_FRAME, FS_ESC, FS_NEXT, FS_NSTATES };
+enum { FC_DATA, FC_FLAG, FC_ESC, FC_LEAD, FC_NCLASSES };
+enum { FA_NONE, FA_PASS, FA_START, FA_ADD, FA_ADDESC, FA_END, FA_ABORT };
+
+#define FT(action, state)	((action) << 4 | (state))
+
+static const unsigned char frame_trans[FS_NSTATES][FC_NCLASSES] =
+{
+    [FS_TEXT] =
+    {
+	[FC_DATA] = FT(FA_PASS, FS_TEXT),
+	[FC_FLAG] = FT(FA_START, FS_FRAME),
+	[FC_ESC] = FT(FA_PASS, FS_TEXT),
+	[FC_LEAD] = FT(FA_PASS, FS_TEXT),
+    },
+    [FS_FRAME] =
+    {
+	[FC_DATA] = FT(FA_ADD, FS_FRAME),
+	[FC_FLAG] = FT(FA_END, FS_TEXT),
+	[FC_ESC] = FT(FA_NONE, FS_ESC),
+	[FC_LEAD] = FT(FA_ADD, FS_FRAME),
+    },
+    [FS_ESC] =
+    {
+	[FC_DATA] = FT(FA_ADDESC, FS_FRAME),
+	[FC_FLAG] = FT(FA_ABORT, FS_FRAME),
+	[FC_ESC] = FT(FA_ADDESC, FS_FRAME),
+	[FC_LEAD] = FT(FA_ADDESC, FS_FRAME),
+    },
+    [FS_NEXT] =
+    {
+	[FC_DATA] = FT(FA_PASS, FS_TEXT),
+	[FC_FLAG] = FT(FA_START, FS_NEXT),
+	[FC_ESC] = FT(FA_PASS, FS_TEXT),
+	[FC_LEAD] = FT(FA_ADD, FS_FRAME),
+    },
+};
+
+struct framing
+{
+    const char *name;
+    unsigned char flag;		/* frame delimiter */
+    unsigned char esc;		/* escape character, same as flag if none */
+    unsigned char esc_xor;	/* escaped characters are xored with this */
+    const char *esc_map;	/* or translated using these pairs */
+    int fcs;			/* frame ends with a 16 bit FCS */
+    int cobs;			/* frame is COBS encoded */
+    unsigned char lead_lo;	/* bytes that can lead a frame right */
+    unsigned char lead_hi;	/* after a frame end, none if 0 */
+};
+
+static const struct framing framings[] =
+{
+    { "none" },
+    { "slip", 0xc0, 0xdb, 0x00, "\xdc\xc0\xdd\xdb", 0, 0, 0, 0 },
+    { "cobs", 0x00, 0x00, 0x00, NULL, 0, 1, 0x01, 0x1f },	/* short runs */
+    { "hdlc", 0x7e, 0x7d, 0x20, NULL, 1, 0, 0xff, 0xff },	/* all-stations */
+    { NULL }
+};
+
+#define FRAME_MAX	4096
+#define FRAME_SHOW	16
+
+static const struct framing *framing = framings;
+static unsigned char frame_class[256];
+static unsigned char frame_unesc[256];
+static unsigned short fcs_table[256];
+static int frame_state;
+static int frame_len;
+static unsigned char frame_buf[FRAME_MAX];
+static char frame_out[8192];
+static int frame_out_len;
+static int frame_out_err;
+static int frame_bol = 1;
+
+static struct
+{
+    unsigned long frames;
+    unsigned long fcs_errors;
+    unsigned long aborts;
+    unsigned long overruns;
+    unsigned long long text_bytes;
+} frame_stats;
+
+static void set_framing(const struct framing *f)
+{
+    const unsigned char *p;
+    int i, j;
+    unsigned short v;
+
+    framing = f;
+    frame_state = FS_TEXT;
+    frame_len = 0;
+    memset(&frame_stats, 0, sizeof(frame_stats));
+
+    for (i = 0; i < 256; i++)
+    {
+	frame_class[i] = FC_DATA;
+	frame_unesc[i] = i ^ f->esc_xor;
+    }
+    for (p = (const unsigned char *)f->esc_map; p && *p; p += 2)
+	frame_unesc[p[0]] = p[1];
+    /* line ends are text, even where a frame could start with one */
+    for (i = f->lead_lo; f->lead_hi && i <= f->lead_hi; i++)
+	if (i != '\t' && i != '\n' && i != '\r')
+	    frame_class[i] = FC_LEAD;
+    frame_class[f->esc] = FC_ESC;
+    frame_class[f->flag] = FC_FLAG;
+
+    /* RFC 1662 FCS-16 */
+    for (i = 0; i < 256; i++)
+    {
+	v = i;
+	for (j = 0; j < 8; j++)
+	    v = v & 1 ? (v >> 1) ^ 0x8408 : v >> 1;
+	fcs_table[i] = v;
+    }
+}
+
+static void frame_flush(void)
+{
+    if (frame_out_len && out_write(frame_out, frame_out_len) == -1)
+	frame_out_err = 1;
+    frame_out_len = 0;
+}
+
+static void frame_emit(const void *buf, int n)
+{
+    if (frame_out_len + n > sizeof(frame_out))
+	frame_flush();
+    if (n > sizeof(frame_out))
+    {
+	if (out_write(buf, n) == -1)
+	    frame_out_err = 1;
+    }
+    else
+    {
+	memcpy(frame_out + frame_out_len, buf, n);
+	frame_out_len += n;
+    }
+    if (n)
+	frame_bol = ((const char *)buf)[n - 1] == '\n';
+}
+
+static int cobs_decode(unsigned char *buf, int len)
+{
+    int i, o, code, k;
+
+    /* decoding in place is safe since the output is never longer */
+    for (i = o = 0; i < len; )
+    {
+	code = buf[i++];
+	if (code == 0 || i + code - 1 > len)
+	    return -1;
+	for (k = 1; k < code; k++)
+	    buf[o++] = buf[i++];
+	if (code != 0xff && i < len)
+	    buf[o++] = 0;
+    }
+    return o;
+}
+
+static void frame_done(void)
+{
+    char s[64 + FRAME_SHOW * 3];
+    const char *status = "";
+    unsigned short fcs;
+    int len = frame_len;
+    int i, k;
+
+    frame_stats.frames++;
+
+    if (framing->cobs && (len = cobs_decode(frame_buf, len)) < 0)
+    {
+	status = " bad cobs";
+	len = frame_len;
+	frame_stats.fcs_errors++;
+    }
+
+    if (framing->fcs)
+    {
+	fcs = 0xffff;
+	for (i = 0; i < len; i++)
+	    fcs = (fcs >> 8) ^ fcs_table[(fcs ^ frame_buf[i]) & 0xff];
+	if (len < 2 || fcs != 0xf0b8)
+	{
+	    status = " bad fcs";
+	    frame_stats.fcs_errors++;
+	}
+	else
+	    len -= 2;
+    }
+
+    k = 0;
+    if (!frame_bol)
+	k += sprintf(s + k, "\r\n");
+    k += sprintf(s + k, "[%s %d%s:", framing->name, len, status);
+    for (i = 0; i < len && i < FRAME_SHOW; i++)
+	k += sprintf(s + k, " %02x", frame_buf[i]);
+    k += sprintf(s + k, "%s]\r\n", len > FRAME_SHOW ? " ..." : "");
+    frame_emit(s, k);
+}
+
+static int frame_rx(const unsigned char *buf, int n)
+{
+    const unsigned char *p = buf;
+    const unsigned char *end = buf + n;
+    const unsigned char *q;
+    int t;
+
+    frame_out_err = 0;
+
+    while (p < end)
+    {
+	/* pass runs of text through in bulk */
+	if (frame_state == FS_TEXT)
+	{
+	    if ((q = memchr(p, framing->flag, end - p)) == NULL)
+		q = end;
+	    frame_emit(p, q - p);
+	    frame_stats.text_bytes += q - p;
+	    if ((p = q) == end)
+		break;
+	}
+
+	t = frame_trans[frame_state][frame_class[*p]];
+	frame_state = t & 0x0f;
+
+	switch (t >> 4)
+	{
+	case FA_PASS:
+	    frame_emit(p, 1);
+	    frame_stats.text_bytes++;
+	    break;
+
+	case FA_START:
+	    frame_len = 0;
+	    break;
+
+	case FA_ADD:
+	case FA_ADDESC:
+	    if (frame_len == FRAME_MAX)
+	    {
+		frame_stats.overruns++;
+		frame_state = FS_TEXT;
+		break;
+	    }
+	    frame_buf[frame_len++] = (t >> 4) == FA_ADD ? *p : frame_unesc[*p];
+	    break;
+
+	case FA_END:
+	    /* back to back delimiters do not end an empty frame */
+	    if (frame_len)
+		frame_done();
+	    else
+		frame_state = FS_FRAME;
+	    if (framing->lead_hi)
+	    {
+		frame_state = FS_NEXT;
+		frame_len = 0;
+	    }
+	    break;
+
+	case FA_ABORT:
+	    frame_stats.aborts++;
+	    frame_len = 0;
+	    break;
+	}
+
+	p++;
+    }
+
+    frame_flush();
+
+    return frame_out_err ? -1 : 0;
+}
+
 /************************************************************************/
 
 static int fuzzy(const char *pattern, char *input, char **args)
@@ -220,627 +776,6603 @@ static int fuzzy(const char *pattern, char *input, char **args)
 static int do_help(char *args, int extra);
 static int do_set_help(char *args, int extra);
 static int do_quit(char *args, int extra);
+static int do_autobaud(char *args, int extra);
+static int handle(char *s);
+
+static void fd_watch(int fd, fd_set *set, int *fd_limit)
+{
+    FD_SET(fd, set);
+    if (fd >= *fd_limit)
+	*fd_limit = fd + 1;
+}
 
 /************************************************************************/
 
-static int do_connect(char *args, int extra)
+/* Ring logs have a fixed size and keep only the most recent data.  The
+   file is a header page followed by the data area, written through a
+   shared mapping; head counts all bytes ever written, so the data ends
+   at head % size and has wrapped once head exceeds size.  A ring file
+   that is opened again with the same size is continued, any other
+   file with data in it is left alone. */
+
+#define RING_MAGIC	"tt ring\n"
+#define RING_DATA	4096		/* offset of the data area */
+
+struct ring_header
 {
-    fd_set readfds;
-    int fd_limit;
-    int r;
-    int escape_seen = 0;
-    char bell = '\a';
-    int term_close = 1;
-    struct timeval tv;
+    char magic[8];
+    uint64_t size;		/* size of the data area */
+    uint64_t head;		/* total number of bytes written */
+};
 
-reconnect:
-    if (!term_name)
-    {
-	fprintf(stderr, "No port selected\n");
+static struct ring_header *log_ring;	/* the log, if it is a ring */
+
+/* Check that the file really holds a data area of the given size, a
+   mapping past its end faults on access */
+static int ring_fits(int fd, uint64_t size)
+{
+    struct stat st;
+
+    if (fstat(fd, &st) == -1)
 	return 0;
-    }
+    return (uint64_t)st.st_size >= RING_DATA
+	&& size <= (uint64_t)st.st_size - RING_DATA;
+}
 
-    if (term_fd == -1)
-	fprintf(stderr, "\nTrying to reconnect to \"%s\"\n", term_name);
-    else
-	fprintf(stderr, "Connected, press \\%03o C to quit\n", escape_char);
-    setup_tty();
+static void *ring_map(int fd, uint64_t size, int prot)
+{
+    void *p = mmap(NULL, RING_DATA + size, prot, MAP_SHARED, fd, 0);
 
-    while (1)
-    {
-	if (term_fd == -1)
-	    fd_limit = 0 + 1;
-	else
-	    fd_limit = term_fd + 1;
+    return p == MAP_FAILED ? NULL : p;
+}
 
-	FD_ZERO(&readfds);
-	FD_SET(0, &readfds);
-	if (term_fd != -1)
-	    FD_SET(term_fd, &readfds);
-	tv.tv_sec = 1;
-	tv.tv_usec = 0;
+/* Check for a file with other data in it, which ring_open would wipe */
+static int ring_foreign(int fd)
+{
+    char magic[sizeof(RING_MAGIC) - 1];
+    struct stat st;
+
+    if (fstat(fd, &st) == -1 || st.st_size == 0)
+	return 0;
+    return pread(fd, magic, sizeof(magic), 0) != sizeof(magic)
+	|| memcmp(magic, RING_MAGIC, sizeof(magic)) != 0;
+}
 
-	if ((r = select(fd_limit, &readfds, NULL, NULL, &tv)) < 0)
+/* Open or create a ring log of the given data size */
+static struct ring_header *ring_open(int fd, uint64_t size)
+{
+    struct ring_header hdr;
+    int err;
+
+    if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)
+	|| memcmp(hdr.magic, RING_MAGIC, sizeof(hdr.magic)) != 0
+	|| hdr.size != size
+	|| !ring_fits(fd, size))
+    {
+	if (ftruncate(fd, 0) == -1)
+	    return NULL;
+	if ((err = posix_fallocate(fd, 0, RING_DATA + size)) != 0)
 	{
-	    perror("select");
-	    break;
+	    errno = err;
+	    return NULL;
 	}
+	memcpy(hdr.magic, RING_MAGIC, sizeof(hdr.magic));
+	hdr.size = size;
+	hdr.head = 0;
+	if (pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+	    return NULL;
+    }
 
-	if (FD_ISSET(0, &readfds))
+    return ring_map(fd, size, PROT_READ | PROT_WRITE);
+}
+
+static ssize_t ring_write(struct ring_header *ring, const struct iovec *iov, int cnt)
+{
+    char *data = (char *)ring + RING_DATA;
+    uint64_t head = ring->head;
+    size_t n, o, k, total = 0;
+    const char *p;
+    int i;
+
+    for (i = 0; i < cnt; i++)
+    {
+	p = iov[i].iov_base;
+	n = iov[i].iov_len;
+	total += n;
+	if (n > ring->size)
 	{
-	    char c;
-	    int n = read(0, &c, 1);
-	    if (n < 0)
-	    {
-		perror("read stdin");
-		break;
-	    }
-	    if (n == 0)
+	    head += n - ring->size;
+	    p += n - ring->size;
+	    n = ring->size;
+	}
+
+	o = head % ring->size;
+	k = n < ring->size - o ? n : ring->size - o;
+	memcpy(data + o, p, k);
+	memcpy(data, p + k, n - k);
+	head += n;
+    }
+
+    /* the head moves only after the data is in place */
+    ring->head = head;
+    return total;
+}
+
+static int uring_log;		/* log writes go through io_uring */
+static ssize_t uring_log_write(const struct iovec *iov, int cnt);
+static void uring_log_drain(void);
+
+/* Write to the log, whichever kind it is */
+static ssize_t log_writev(const struct iovec *iov, int cnt)
+{
+    if (log_ring)
+	return ring_write(log_ring, iov, cnt);
+    if (uring_log)
+	return uring_log_write(iov, cnt);
+    return writev(log_fd, iov, cnt);
+}
+
+/************************************************************************/
+
+/* Log durability.  Syncing every write would kill throughput, so
+   fdatasync calls are batched: either when the unsynced data reaches
+   a byte count or when the oldest unsynced data reaches a given age.
+   In bytes mode data older than a second is also synced, so the
+   window is always bounded.  The file is preallocated ahead of the
+   writes so that a sync rarely has to commit block allocations. */
+
+enum { LOG_SYNC_NONE, LOG_SYNC_INTERVAL, LOG_SYNC_BYTES };
+
+#define LOG_PREALLOC	(16 << 20)
+
+static char *log_name;
+static int log_sync_mode = LOG_SYNC_NONE;
+static long log_sync_ms;
+static long log_sync_bytes;
+static off_t log_pos;
+static off_t log_alloc;
+static long log_unsynced;
+static long long log_dirty_since;
+
+static struct
+{
+    unsigned long syncs;
+    long long sync_us;
+    long long max_window_us;
+    long max_unsynced;
+} log_stats;
+
+static void log_sync(void)
+{
+    long long now, t;
+
+    if (log_fd == -1 || log_unsynced == 0)
+	return;
+
+    uring_log_drain();
+    now = now_us();
+    if (fdatasync(log_fd) == -1)
+	perror("fdatasync");
+    t = now_us();
+
+    log_stats.syncs++;
+    log_stats.sync_us += t - now;
+    if (t - log_dirty_since > log_stats.max_window_us)
+	log_stats.max_window_us = t - log_dirty_since;
+    if (log_unsynced > log_stats.max_unsynced)
+	log_stats.max_unsynced = log_unsynced;
+    log_unsynced = 0;
+}
+
+/* Account for data written to the log */
+static void log_written(long n)
+{
+    if (n <= 0)
+	return;
+
+    log_pos += n;
+    if (!log_ring && log_pos + LOG_PREALLOC / 2 > log_alloc)
+    {
+	log_alloc = log_pos + LOG_PREALLOC;
+	fallocate(log_fd, FALLOC_FL_KEEP_SIZE, 0, log_alloc);
+    }
+
+    if (log_sync_mode == LOG_SYNC_NONE)
+	return;
+
+    if (log_unsynced == 0)
+	log_dirty_since = now_us();
+    log_unsynced += n;
+
+    if (log_sync_mode == LOG_SYNC_BYTES && log_unsynced >= log_sync_bytes)
+	log_sync();
+}
+
+/* Returns the number of microseconds until the log needs a sync, or
+   -1 if it does not need one */
+static long long log_sync_timeout(void)
+{
+    long long t;
+
+    if (log_sync_mode == LOG_SYNC_NONE || log_unsynced == 0)
+	return -1;
+
+    if (log_sync_mode == LOG_SYNC_INTERVAL)
+	t = log_dirty_since + log_sync_ms * 1000LL - now_us();
+    else
+	t = log_dirty_since + 1000000 - now_us();
+
+    return t < 0 ? 0 : t;
+}
+
+static void log_close(void)
+{
+    if (log_fd == -1)
+	return;
+
+    uring_log_drain();
+    if (log_sync_mode != LOG_SYNC_NONE)
+	log_sync();
+
+    /* give back the preallocated space beyond the end of the log */
+    if (log_ring)
+    {
+	munmap(log_ring, RING_DATA + log_ring->size);
+	log_ring = NULL;
+    }
+    else
+	ftruncate(log_fd, log_pos);
+    close(log_fd);
+    log_fd = -1;
+    free(log_name);
+    log_name = NULL;
+}
+
+/************************************************************************/
+
+/* Clean text log.  "log clean <file>" writes a second log with the
+   terminal control sequences taken out, so that it can be grepped and
+   diffed; the raw log is not affected.  The escape sequence parser
+   keeps its state between chunks.  CSI sequences (colours, cursor
+   movement), OSC, DCS, SOS, PM and APC strings and other escape
+   sequences are removed, CR LF and lone CRs become LF, and other
+   control characters except tab are dropped.  Plain text is found 16
+   bytes at a time with SSE2 and copied in one go. */
+
+enum { CLEAN_TEXT, CLEAN_ESC, CLEAN_ESC_INTER, CLEAN_CSI, CLEAN_STRING,
+       CLEAN_STRING_ESC };
+
+#define CLEAN_BUF	8192
+
+static int clean_fd = -1;
+static char *clean_name;
+static int clean_state;
+static int clean_cr;		/* a CR is waiting, an LF may follow */
+static unsigned long long clean_in, clean_out, clean_removed;
+
+static void clean_close(void)
+{
+    if (clean_fd == -1)
+	return;
+
+    close(clean_fd);
+    clean_fd = -1;
+    free(clean_name);
+    clean_name = NULL;
+}
+
+#define CLEAN_CTL(c)	(((c) < 0x20 && (c) != '\n' && (c) != '\t') || (c) == 0x7f)
+
+/* Returns the number of bytes of plain text at the start of buf */
+static int clean_find(const char *buf, int n)
+{
+    int i = 0;
+    unsigned char c;
+
+#ifdef __SSE2__
+    __m128i ctl = _mm_set1_epi8(0x1f), lf = _mm_set1_epi8('\n');
+    __m128i tab = _mm_set1_epi8('\t'), del = _mm_set1_epi8(0x7f);
+    __m128i v, hit;
+    int m;
+
+    for (; i + 16 <= n; i += 16)
+    {
+	v = _mm_loadu_si128((const __m128i *)(buf + i));
+	/* controls other than LF and tab, and DEL */
+	hit = _mm_cmpeq_epi8(_mm_min_epu8(v, ctl), v);
+	hit = _mm_andnot_si128(_mm_or_si128(_mm_cmpeq_epi8(v, lf),
+					    _mm_cmpeq_epi8(v, tab)), hit);
+	hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, del));
+	if ((m = _mm_movemask_epi8(hit)) != 0)
+	    return i + __builtin_ctz(m);
+    }
+#endif
+
+    for (; i < n; i++)
+    {
+	c = buf[i];
+	if (CLEAN_CTL(c))
+	    break;
+    }
+    return i;
+}
+
+static void clean_data(const char *buf, int n)
+{
+    char out[CLEAN_BUF];
+    const char *p = buf, *end = buf + n;
+    unsigned char c;
+    int len = 0, k, plain;
+
+    while (p < end)
+    {
+	if (len >= CLEAN_BUF - 1)
+	{
+	    write_all(clean_fd, out, len);
+	    clean_out += len;
+	    len = 0;
+	}
+
+	if (clean_state == CLEAN_TEXT)
+	{
+	    if (clean_cr && *p != '\r')
+	    {
+		out[len++] = '\n';
+		clean_cr = 0;
+		if (*p == '\n')
+		{
+		    p++;
+		    continue;
+		}
+	    }
+
+	    c = *p;
+	    if (!CLEAN_CTL(c))
+	    {
+		plain = clean_find(p, end - p);
+		k = plain < CLEAN_BUF - len ? plain : CLEAN_BUF - len;
+		memcpy(out + len, p, k);
+		len += k;
+		p += k;
+		if (k < plain || p == end)
+		    continue;
+	    }
+
+	    c = *p++;
+	    if (c == '\r')
+		clean_cr = 1;
+	    else if (c == 0x1b)
+	    {
+		clean_state = CLEAN_ESC;
+		clean_removed++;
+	    }
+	    continue;
+	}
+
+	c = *p++;
+	switch (clean_state)
+	{
+	case CLEAN_ESC:
+	    if (c == '[')
+		clean_state = CLEAN_CSI;
+	    else if (c == ']' || c == 'P' || c == 'X' || c == '^' || c == '_')
+		clean_state = CLEAN_STRING;
+	    else if (c >= 0x20 && c <= 0x2f)
+		clean_state = CLEAN_ESC_INTER;
+	    else if (c != 0x1b)
+		clean_state = CLEAN_TEXT;
+	    break;
+
+	case CLEAN_ESC_INTER:
+	    if (c >= 0x30 && c <= 0x7e)
+		clean_state = CLEAN_TEXT;
+	    break;
+
+	case CLEAN_CSI:
+	    /* parameters and intermediates up to the final byte, CAN
+	       and SUB cancel the sequence */
+	    if ((c >= 0x40 && c <= 0x7e) || c == 0x18 || c == 0x1a)
+		clean_state = CLEAN_TEXT;
+	    else if (c == 0x1b)
+		clean_state = CLEAN_ESC;
+	    break;
+
+	case CLEAN_STRING:
+	    /* ended by BEL or ST, that is ESC \ */
+	    if (c == 0x07)
+		clean_state = CLEAN_TEXT;
+	    else if (c == 0x1b)
+		clean_state = CLEAN_STRING_ESC;
+	    break;
+
+	case CLEAN_STRING_ESC:
+	    if (c == '\\')
+		clean_state = CLEAN_TEXT;
+	    else
+	    {
+		/* not ST, so the start of another sequence */
+		clean_state = CLEAN_ESC;
+		p--;
+	    }
+	    break;
+	}
+    }
+
+    if (len)
+    {
+	write_all(clean_fd, out, len);
+	clean_out += len;
+    }
+    clean_in += n;
+}
+
+/************************************************************************/
+
+/* Timestamped logs have every line prefixed with "[seconds.usecs] "
+   with the wall clock time when the first character of the line was
+   received. */
+
+static int log_bol = 1;
+
+static int parse_timestamp(const char *s, long long *us)
+{
+    const char *p = s;
+    long long sec = 0;
+    long usec = 0;
+    int i;
+
+    if (*p++ != '[' || !isdigit(*p))
+	return 0;
+    while (isdigit(*p))
+	sec = sec * 10 + *p++ - '0';
+    if (*p++ != '.')
+	return 0;
+    for (i = 0; i < 6; i++)
+    {
+	if (!isdigit(*p))
+	    return 0;
+	usec = usec * 10 + *p++ - '0';
+    }
+    if (*p++ != ']' || *p++ != ' ')
+	return 0;
+
+    *us = sec * 1000000 + usec;
+    return p - s;
+}
+
+static void log_data(const char *buf, int n)
+{
+    struct iovec iov[64];
+    struct timeval tv;
+    char ts[32];
+    const char *p, *q;
+    int ts_len;
+    int i;
+
+    if (clean_fd != -1)
+	clean_data(buf, n);
+
+    if (log_fd == -1)
+	return;
+
+    if (!flag_timestamp)
+    {
+	iov[0].iov_base = (void *)buf;
+	iov[0].iov_len = n;
+	log_written(log_writev(iov, 1));
+	return;
+    }
+
+    gettimeofday(&tv, NULL);
+    ts_len = sprintf(ts, "[%ld.%06ld] ", (long)tv.tv_sec, (long)tv.tv_usec);
+
+    i = 0;
+    for (p = buf; p < buf + n; p = q)
+    {
+	if ((q = memchr(p, '\n', buf + n - p)) != NULL)
+	    q++;
+	else
+	    q = buf + n;
+
+	if (i + 2 > sizeof(iov) / sizeof(iov[0]))
+	{
+	    log_written(log_writev(iov, i));
+	    i = 0;
+	}
+
+	if (log_bol)
+	{
+	    iov[i].iov_base = ts;
+	    iov[i++].iov_len = ts_len;
+	}
+	iov[i].iov_base = (void *)p;
+	iov[i++].iov_len = q - p;
+	log_bol = q[-1] == '\n';
+    }
+    log_written(log_writev(iov, i));
+}
+
+/************************************************************************/
+
+/* Translation of the data sent and shown.  Each direction has a table
+   giving the output for every input byte, built by running the rules
+   in order over all 256 values.  Most data needs no translation, so a
+   chunk is first scanned for bytes the table changes, 16 at a time
+   with SSE2 when the changed bytes are few enough or all the bytes
+   with the high bit set, and runs of unchanged bytes are passed on as
+   they are. */
+
+#define XLAT_RULES	16
+#define XLAT_OUT	4		/* at most this many bytes for one */
+#define XLAT_SCAN_MAX	4
+
+struct xlat
+{
+    int active;
+    char *rules;			/* as given, for show */
+    unsigned char changes[256];
+    unsigned char len[256];
+    unsigned char out[256][XLAT_OUT];
+    int nscan;				/* -1 if too many to scan for */
+    int scan_high;			/* bytes >= 0x80 change */
+    unsigned char scan[XLAT_SCAN_MAX];
+};
+
+static struct xlat xlat_rx, xlat_tx;
+static int flag_echo;
+
+/* Return the offset of the first byte that changes, or n */
+static int xlat_find(const struct xlat *x, const char *buf, int n)
+{
+    int i = 0;
+
+#ifdef __SSE2__
+    if (x->nscan >= 0)
+    {
+	__m128i c[XLAT_SCAN_MAX], v, hit;
+	int k, m;
+
+	for (k = 0; k < x->nscan; k++)
+	    c[k] = _mm_set1_epi8(x->scan[k]);
+
+	for (; i + 16 <= n; i += 16)
+	{
+	    v = _mm_loadu_si128((const __m128i *)(buf + i));
+	    hit = x->scan_high ? v : _mm_setzero_si128();
+	    for (k = 0; k < x->nscan; k++)
+		hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, c[k]));
+	    if ((m = _mm_movemask_epi8(hit)) != 0)
+		return i + __builtin_ctz(m);
+	}
+    }
+#endif
+
+    for (; i < n; i++)
+	if (x->changes[(unsigned char)buf[i]])
+	    break;
+    return i;
+}
+
+/* Translate buf into out, which must have room for XLAT_OUT * n bytes */
+static int xlat_copy(const struct xlat *x, const char *buf, int n, char *out)
+{
+    const unsigned char *p = (const unsigned char *)buf;
+    char *q = out;
+    int i, k, end;
+
+    for (i = 0; i < n; i = k)
+    {
+	k = i + xlat_find(x, buf + i, n - i);
+	memcpy(q, buf + i, k - i);
+	q += k - i;
+
+	/* changed bytes tend to come together, so go on with the table
+	   for a while before scanning again */
+	for (end = k + 16 < n ? k + 16 : n; k < end; k++)
+	{
+	    memcpy(q, x->out[p[k]], x->len[p[k]]);
+	    q += x->len[p[k]];
+	}
+    }
+
+    return q - out;
+}
+
+/* Build the table from rules: "strip" clears the high bit, "<c>=<s>"
+   replaces the character c with the string s, which may be empty */
+static int xlat_set(struct xlat *x, char *rules)
+{
+    struct
+    {
+	int strip;
+	unsigned char from;
+	unsigned char to[XLAT_OUT];
+	int to_len;
+    } r[XLAT_RULES];
+    unsigned char cur[XLAT_OUT], next[XLAT_OUT];
+    char *copy, *p, *eq;
+    int nrules = 0, cur_len, next_len;
+    int c, i, j, k;
+
+    if ((copy = strdup(rules)) == NULL)
+	return -1;
+
+    for (p = strtok(rules, " \t"); p; p = strtok(NULL, " \t"))
+    {
+	if (nrules == XLAT_RULES)
+	    goto invalid;
+	r[nrules].strip = strcasecmp(p, "strip") == 0;
+	if (!r[nrules].strip)
+	{
+	    if ((eq = strchr(p + 1, '=')) == NULL)
+		goto invalid;
+	    *eq++ = '\0';
+	    if (unescape(p) != 1 || (k = unescape(eq)) > XLAT_OUT)
+		goto invalid;
+	    r[nrules].from = *p;
+	    memcpy(r[nrules].to, eq, k);
+	    r[nrules].to_len = k;
+	}
+	nrules++;
+    }
+    if (!nrules)
+	goto invalid;
+
+    x->nscan = 0;
+    x->scan_high = 1;
+    for (c = 0; c < 256; c++)
+    {
+	cur[0] = c;
+	cur_len = 1;
+	for (i = 0; i < nrules; i++)
+	{
+	    for (j = next_len = 0; j < cur_len; j++)
+	    {
+		if (r[i].strip)
+		    next[next_len++] = cur[j] & 0x7f;
+		else if (cur[j] != r[i].from)
+		    next[next_len++] = cur[j];
+		else
+		    for (k = 0; k < r[i].to_len && next_len < XLAT_OUT; k++)
+			next[next_len++] = r[i].to[k];
+	    }
+	    memcpy(cur, next, next_len);
+	    cur_len = next_len;
+	}
+
+	memcpy(x->out[c], cur, cur_len);
+	x->len[c] = cur_len;
+	x->changes[c] = cur_len != 1 || cur[0] != c;
+
+	/* what the fast scan has to look for */
+	if (c >= 0x80 && !x->changes[c])
+	    x->scan_high = 0;
+	if (x->changes[c] && c < 0x80 && x->nscan >= 0)
+	{
+	    if (x->nscan < XLAT_SCAN_MAX)
+		x->scan[x->nscan++] = c;
+	    else
+		x->nscan = -1;
+	}
+    }
+    if (!x->scan_high && x->nscan >= 0)
+    {
+	for (c = 0x80; c < 256; c++)
+	{
+	    if (!x->changes[c])
+		continue;
+	    if (x->nscan == XLAT_SCAN_MAX)
+	    {
+		x->nscan = -1;
+		break;
+	    }
+	    x->scan[x->nscan++] = c;
+	}
+    }
+
+    free(x->rules);
+    x->rules = copy;
+    x->active = 1;
+    return 0;
+
+invalid:
+    free(copy);
+    return -1;
+}
+
+/************************************************************************/
+
+/* RS-485 half duplex.  Where the driver supports it the kernel drives
+   RTS around each transmission (TIOCSRS485), which gives the tightest
+   bus turnaround.  Otherwise RTS is switched from tx_run(): asserted
+   before the first byte of a burst and released once TIOCOUTQ says
+   the last byte has left the transmitter.  The waits in between run
+   on the pacing timerfd, so reception goes on meanwhile.  Only the
+   kernel can turn the receiver off while sending, in software mode
+   the transceiver decides whether our own data comes back. */
+
+enum { RS485_OFF, RS485_KERNEL, RS485_SOFTWARE };
+enum { RS485_IDLE, RS485_BEFORE, RS485_SENDING, RS485_DRAINING, RS485_AFTER };
+
+static int rs485_mode = RS485_OFF;
+static int rs485_wanted;		/* mode asked for, for new ports */
+static int rs485_rts_low;		/* RTS is low while sending */
+static long rs485_before_ms, rs485_after_ms;
+static int rs485_rx_during_tx;
+static int rs485_state;
+static long rs485_char_us;		/* time on the wire per character */
+
+static void rs485_rts(int fd, int sending)
+{
+    int bit = TIOCM_RTS;
+
+    ioctl(fd, sending != rs485_rts_low ? TIOCMBIS : TIOCMBIC, &bit);
+}
+
+/* Set up a port for the RS-485 mode asked for */
+static void rs485_apply(int fd)
+{
+    struct serial_rs485 rs485;
+
+    memset(&rs485, 0, sizeof(rs485));
+    rs485_state = RS485_IDLE;
+
+    if (rs485_wanted == RS485_KERNEL)
+    {
+	rs485.flags = SER_RS485_ENABLED
+	    | (rs485_rts_low ? SER_RS485_RTS_AFTER_SEND : SER_RS485_RTS_ON_SEND)
+	    | (rs485_rx_during_tx ? SER_RS485_RX_DURING_TX : 0);
+	rs485.delay_rts_before_send = rs485_before_ms;
+	rs485.delay_rts_after_send = rs485_after_ms;
+	if (ioctl(fd, TIOCSRS485, &rs485) == 0)
+	{
+	    rs485_mode = RS485_KERNEL;
+	    return;
+	}
+	fprintf(stderr, "TIOCSRS485: %s, switching RTS in software\n",
+		strerror(errno));
+    }
+    else if (rs485_mode == RS485_KERNEL)
+	ioctl(fd, TIOCSRS485, &rs485);
+
+    rs485_mode = rs485_wanted == RS485_OFF ? RS485_OFF : RS485_SOFTWARE;
+    if (rs485_mode == RS485_SOFTWARE)
+	rs485_rts(fd, 0);
+}
+
+/* Software direction control, called before sending.  Returns the
+   number of microseconds to wait before calling again, or 0 when the
+   data can go. */
+static long long rs485_begin(void)
+{
+    if (rs485_mode != RS485_SOFTWARE)
+	return 0;
+
+    if (rs485_state == RS485_IDLE)
+    {
+	rs485_rts(term_fd, 1);
+	if (rs485_before_ms)
+	{
+	    rs485_state = RS485_BEFORE;
+	    return rs485_before_ms * 1000LL;
+	}
+    }
+
+    /* more data while finishing a burst, RTS is still on */
+    rs485_state = RS485_SENDING;
+    return 0;
+}
+
+/* Called when there is nothing left to send.  Returns the number of
+   microseconds to wait before calling again, or 0 once RTS is off. */
+static long long rs485_end(void)
+{
+    struct termios termios;
+    long speed;
+    int outq;
+
+    if (rs485_mode != RS485_SOFTWARE || rs485_state == RS485_IDLE)
+	return 0;
+
+    if (rs485_state == RS485_SENDING)
+    {
+	speed = tcgetattr(term_fd, &termios) == -1 ? -1
+	    : code_to_speed(cfgetospeed(&termios));
+	rs485_char_us = speed > 0 ? 10000000L / speed + 1 : 1000;
+	rs485_state = RS485_DRAINING;
+    }
+
+    if (rs485_state == RS485_DRAINING)
+    {
+	if (ioctl(term_fd, TIOCOUTQ, &outq) == -1)
+	{
+	    tcdrain(term_fd);
+	    outq = 0;
+	}
+	if (outq > 0)
+	    return (long long)outq * rs485_char_us;
+
+	/* the last character is still in the shift register */
+	rs485_state = RS485_AFTER;
+	return rs485_char_us + rs485_after_ms * 1000LL;
+    }
+
+    rs485_rts(term_fd, 0);
+    rs485_state = RS485_IDLE;
+    return 0;
+}
+
+/* Release the bus before the port is left alone */
+static void rs485_finish(void)
+{
+    long long t;
+
+    while ((t = rs485_end()) > 0)
+	usleep(t);
+}
+
+/************************************************************************/
+
+/* Transmit queue.  Everything sent to the port goes through this
+   queue so that a full port buffer or pacing never blocks reception.
+   With pacing enabled, a timerfd in the connect loop is armed with the
+   deadline for the next character or line. */
+
+#define TX_QUEUE_SIZE	65536
+
+static char tx_queue[TX_QUEUE_SIZE];
+static unsigned int tx_head, tx_tail;
+static int pace_fd = -1;
+static int tx_wait;
+static long long tx_deadline;
+
+static int tx_space(void)
+{
+    return TX_QUEUE_SIZE - (tx_head - tx_tail);
+}
+
+static void tx_flush(void)
+{
+    struct itimerspec its;
+
+    tx_head = tx_tail = 0;
+    tx_wait = 0;
+    if (pace_fd != -1)
+    {
+	memset(&its, 0, sizeof(its));
+	timerfd_settime(pace_fd, 0, &its, NULL);
+    }
+}
+
+static int tx_timer_open(void)
+{
+    if (pace_fd == -1 &&
+	(pace_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1)
+    {
+	perror("timerfd_create");
+	return -1;
+    }
+    return 0;
+}
+
+/* Hold the queue for a while, for RS-485 direction changes */
+static int tx_delay(long long delay)
+{
+    struct itimerspec its;
+
+    if (tx_timer_open() == -1)
+	return -1;
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = delay / 1000000;
+    its.it_value.tv_nsec = delay % 1000000 * 1000;
+    if (timerfd_settime(pace_fd, 0, &its, NULL) == -1)
+    {
+	perror("timerfd_settime");
+	return -1;
+    }
+    tx_wait = 1;
+    return 0;
+}
+
+static void tx_pace(long long delay)
+{
+    struct itimerspec its;
+    long long now = now_us();
+
+    /* keep the average rate exact even if we wake up late */
+    if (now - tx_deadline < delay)
+	tx_deadline += delay;
+    else
+	tx_deadline = now + delay;
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = tx_deadline / 1000000;
+    its.it_value.tv_nsec = tx_deadline % 1000000 * 1000;
+    if (timerfd_settime(pace_fd, TFD_TIMER_ABSTIME, &its, NULL) == -1)
+	perror("timerfd_settime");
+    else
+	tx_wait = 1;
+}
+
+/* Write as much of the queue as the port and pacing allows */
+static int tx_run(void)
+{
+    const char *p, *eol;
+    long long t;
+    int n, r;
+
+    /* without the timer the wait is done here, as a last resort */
+    if (tx_head != tx_tail && !tx_wait && term_fd != -1)
+	while ((t = rs485_begin()) > 0)
+	{
+	    if (tx_delay(t) == 0)
+		return 0;
+	    usleep(t);
+	}
+
+    while (tx_head != tx_tail && !tx_wait && term_fd != -1)
+    {
+	p = tx_queue + tx_tail % TX_QUEUE_SIZE;
+	n = tx_head - tx_tail;
+	if (n > TX_QUEUE_SIZE - tx_tail % TX_QUEUE_SIZE)
+	    n = TX_QUEUE_SIZE - tx_tail % TX_QUEUE_SIZE;
+
+	if (pace_char_us)
+	    n = 1;
+	else if (pace_line_ms)
+	{
+	    for (eol = p; eol < p + n - 1 && *eol != '\r' && *eol != '\n'; eol++)
+		;
+	    n = eol - p + 1;
+	}
+
+	if ((r = write(term_fd, p, n)) < 0)
+	{
+	    if (errno == EAGAIN)
+		return 0;
+	    fprintf(stderr, "write term_fd: %s (%d)\n", strerror(errno), errno);
+	    return -1;
+	}
+	tx_tail += r;
+
+	if (r && pace_line_ms && (p[r - 1] == '\r' || p[r - 1] == '\n'))
+	    tx_pace(pace_line_ms * 1000LL);
+	else if (r && pace_char_us)
+	    tx_pace(pace_char_us);
+    }
+
+    if (tx_head == tx_tail && !tx_wait && term_fd != -1)
+	while ((t = rs485_end()) > 0 && tx_delay(t) == -1)
+	    usleep(t);
+
+    return 0;
+}
+
+/* Queue data to be sent to the port */
+static int tx_data(const char *buf, int n)
+{
+    const unsigned char *p = (const unsigned char *)buf;
+    int i, k, len;
+
+    if (flag_echo)
+	out_write(buf, n);
+
+    k = xlat_tx.active ? xlat_find(&xlat_tx, buf, n) : n;
+    for (i = k, len = n; i < n; i++)
+	len += xlat_tx.len[p[i]] - 1;
+
+    if (len > tx_space())
+    {
+	fprintf(stderr, "write term_fd: transmit queue full\n");
+	return -1;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+	if (i < k || !xlat_tx.changes[p[i]])
+	    tx_queue[tx_head++ % TX_QUEUE_SIZE] = buf[i];
+	else
+	    for (len = 0; len < xlat_tx.len[p[i]]; len++)
+		tx_queue[tx_head++ % TX_QUEUE_SIZE] = xlat_tx.out[p[i]][len];
+    }
+
+    return tx_run();
+}
+
+/* Queue data as it is, for the pty passthrough */
+static int tx_put(const char *buf, int n)
+{
+    int i;
+
+    if (n > tx_space())
+    {
+	fprintf(stderr, "write term_fd: transmit queue full\n");
+	return -1;
+    }
+
+    for (i = 0; i < n; i++)
+	tx_queue[tx_head++ % TX_QUEUE_SIZE] = buf[i];
+
+    return tx_run();
+}
+
+/************************************************************************/
+
+static int rx_bol = 1;		/* last output ended a line */
+
+/* Show received data, translated */
+static int rx_show(const char *buf, int n)
+{
+    char out[256 * XLAT_OUT];
+    int k;
+
+    if (!xlat_rx.active || (k = xlat_find(&xlat_rx, buf, n)) == n)
+	return out_write(buf, n);
+
+    if (out_write(buf, k) == -1)
+	return -1;
+    for (buf += k, n -= k; n > 0; buf += k, n -= k)
+    {
+	k = n < 256 ? n : 256;
+	if (out_write(out, xlat_copy(&xlat_rx, buf, k, out)) == -1)
+	    return -1;
+    }
+    return 0;
+}
+
+/* Show received data in hex after the data itself */
+static void rx_hex(const char *buf, int n)
+{
+    int i;
+    char s[16];
+
+    for (i = 0; i < n; i++)
+    {
+	sprintf(s, "[%02x]", buf[i]);
+	out_write(s, 4);
+    }
+    out_write("\r\n", 2);
+}
+
+/************************************************************************/
+
+/* Recording a region of the received stream to a file with "record",
+   for memory dumps and the like.  Captured data is not shown but still goes to
+   the log.  CRC-32 (as in zlib and U-Boot's crc32 command) and CRC-32C
+   are computed as the data arrives, CRC-32C with the SSE 4.2
+   instruction when the CPU has it and both otherwise with slice-by-8
+   tables.  When capturing until a pattern, a tail of each chunk that
+   could be the start of the pattern is held back until the next. */
+
+#define CAP_PATTERN_MAX	64
+
+static int cap_fd = -1;
+static char *cap_name;
+static char cap_pattern[CAP_PATTERN_MAX];
+static int cap_pattern_len;
+static char cap_hold[CAP_PATTERN_MAX];
+static int cap_hold_len;
+static char cap_rest[CAP_PATTERN_MAX];	/* held back, but not captured */
+static int cap_rest_len;
+static unsigned long long cap_left;	/* bytes to go, 0 without a limit */
+static int cap_ending;			/* cap_done() once the data is logged */
+static unsigned long long cap_bytes;
+static long long cap_first_us, cap_last_us;
+static uint32_t cap_crc32, cap_crc32c;
+static int cap_crc32c_hw;
+
+static uint32_t crc32_table[8][256];
+static uint32_t crc32c_table[8][256];
+
+static void crc_init(uint32_t table[8][256], uint32_t poly)
+{
+    uint32_t c;
+    int i, j;
+
+    for (i = 0; i < 256; i++)
+    {
+	c = i;
+	for (j = 0; j < 8; j++)
+	    c = c & 1 ? (c >> 1) ^ poly : c >> 1;
+	table[0][i] = c;
+    }
+    for (i = 0; i < 256; i++)
+	for (j = 1; j < 8; j++)
+	    table[j][i] = (table[j - 1][i] >> 8) ^ table[0][table[j - 1][i] & 0xff];
+}
+
+static uint32_t crc_update(uint32_t table[8][256], uint32_t crc,
+			   const unsigned char *p, size_t n)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    uint32_t a, b;
+
+    for (; n >= 8; p += 8, n -= 8)
+    {
+	memcpy(&a, p, 4);
+	memcpy(&b, p + 4, 4);
+	a ^= crc;
+	crc = table[7][a & 0xff] ^ table[6][(a >> 8) & 0xff]
+	    ^ table[5][(a >> 16) & 0xff] ^ table[4][a >> 24]
+	    ^ table[3][b & 0xff] ^ table[2][(b >> 8) & 0xff]
+	    ^ table[1][(b >> 16) & 0xff] ^ table[0][b >> 24];
+    }
+#endif
+    while (n--)
+	crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#ifdef HAVE_CRC32C_HW
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t n)
+{
+    uint64_t v;
+
+    for (; n >= 8; p += 8, n -= 8)
+    {
+	memcpy(&v, p, 8);
+	crc = _mm_crc32_u64(crc, v);
+    }
+    while (n--)
+	crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+#endif
+
+static void cap_write(const char *buf, int n)
+{
+    if (n <= 0 || cap_fd == -1)
+	return;
+
+    if (write_all(cap_fd, buf, n) == -1)
+    {
+	perror(cap_name);
+	close(cap_fd);
+	cap_fd = -1;
+	return;
+    }
+
+    cap_crc32 = crc_update(crc32_table, cap_crc32, (const unsigned char *)buf, n);
+#ifdef HAVE_CRC32C_HW
+    if (cap_crc32c_hw)
+	cap_crc32c = crc32c_hw(cap_crc32c, (const unsigned char *)buf, n);
+    else
+#endif
+	cap_crc32c = crc_update(crc32c_table, cap_crc32c,
+				(const unsigned char *)buf, n);
+    cap_bytes += n;
+    cap_last_us = now_us();
+}
+
+/* End the capture and report on it */
+static void cap_done(void)
+{
+    char s[PATH_MAX + 256];
+    double t;
+    int k;
+
+    if (!cap_name)
+	return;
+
+    cap_write(cap_hold, cap_hold_len);
+    cap_hold_len = 0;
+
+    t = cap_bytes ? (cap_last_us - cap_first_us) / 1e6 : 0;
+    k = snprintf(s, sizeof(s),
+		 "%s[record \"%s\": %llu bytes in %.3f s, %.1f KiB/s,"
+		 " CRC-32 %08x, CRC-32C %08x]\r\n",
+		 rx_bol ? "" : "\r\n", cap_name, cap_bytes, t,
+		 t > 0 ? cap_bytes / t / 1024 : 0.0,
+		 (unsigned)~cap_crc32, (unsigned)~cap_crc32c);
+
+    if (cap_fd != -1 && close(cap_fd) == -1)
+	perror(cap_name);
+    cap_fd = -1;
+    free(cap_name);
+    cap_name = NULL;
+
+    cap_ending = 0;
+    if (k >= sizeof(s))
+	k = sizeof(s) - 1;
+    log_data(s, k);
+    rx_bol = 1;
+    out_write(s, k);
+}
+
+/* Pass received data to the capture, returns how much of it was taken.
+   When that ends the capture cap_ending is set, and the caller calls
+   cap_done() after logging what was taken, so that the summary follows
+   the data in the log. */
+static int cap_data(const char *buf, int n)
+{
+    char win[2 * CAP_PATTERN_MAX];
+    const char *m;
+    int w, k, keep;
+
+    if (!cap_first_us)
+	cap_first_us = now_us();
+
+    if (cap_left)
+    {
+	k = n < cap_left ? n : cap_left;
+	cap_write(buf, k);
+	if ((cap_left -= k) == 0)
+	    cap_ending = 1;
+	return k;
+    }
+
+    if (!cap_pattern_len)
+    {
+	cap_write(buf, n);
+	return n;
+    }
+
+    /* a match starting in the held back bytes, which have been logged
+       already but not shown */
+    w = n < cap_pattern_len - 1 ? n : cap_pattern_len - 1;
+    memcpy(win, cap_hold, cap_hold_len);
+    memcpy(win + cap_hold_len, buf, w);
+    if ((m = memmem(win, cap_hold_len + w, cap_pattern, cap_pattern_len)) != NULL
+	&& m - win < cap_hold_len)
+    {
+	k = m - win;
+	cap_write(cap_hold, k);
+	cap_rest_len = cap_hold_len - k;
+	memcpy(cap_rest, cap_hold + k, cap_rest_len);
+	cap_hold_len = 0;
+	cap_ending = 1;
+	return 0;
+    }
+
+    if ((m = memmem(buf, n, cap_pattern, cap_pattern_len)) != NULL)
+    {
+	cap_write(cap_hold, cap_hold_len);
+	cap_hold_len = 0;
+	cap_write(buf, m - buf);
+	cap_ending = 1;
+	return m - buf;
+    }
+
+    keep = cap_hold_len + n < cap_pattern_len - 1
+	? cap_hold_len + n : cap_pattern_len - 1;
+    if (n >= keep)
+    {
+	cap_write(cap_hold, cap_hold_len);
+	cap_write(buf, n - keep);
+	memcpy(cap_hold, buf + n - keep, keep);
+    }
+    else
+    {
+	k = cap_hold_len + n - keep;
+	cap_write(cap_hold, k);
+	memmove(cap_hold, cap_hold + k, cap_hold_len - k);
+	memcpy(cap_hold + cap_hold_len - k, buf, n);
+    }
+    cap_hold_len = keep;
+
+    return n;
+}
+
+/************************************************************************/
+
+/* Comparison with golden output.  Lines are normalised before they
+   are compared, so that what changes from run to run does not count:
+   control characters and escape sequences are dropped, tt timestamps
+   are removed, kernel style "[   12.345678]" timestamps, 0x numbers
+   and other hex numbers of 8 digits or more are masked, trailing
+   blanks go, and the regular expression masks set with "golden mask"
+   or -m replace what they match with '#'.  Blank lines are ignored.
+   Each line is then reduced to a 64 bit hash and only the hashes are
+   compared.  "tt compare" diffs two logs, the "golden" command
+   follows the received data against a golden log while connected. */
+
+#define CMP_LINE_MAX	4096
+#define CMP_MASKS	16
+#define CMP_WINDOW	256		/* how far ahead a live line is looked for */
+
+struct cmp_file
+{
+    char *name;
+    char *data;
+    size_t size;
+    long n;			/* lines that are not blank */
+    long *line;			/* offset of each line */
+    long *lineno;
+    uint64_t *hash;
+};
+
+static regex_t cmp_masks[CMP_MASKS];
+static int cmp_nmasks;
+static int cmp_defaults = 1;
+
+#define CMP_HEX(c)	isxdigit((unsigned char)(c))
+
+/* Normalise a line into out, which must have room for len + 1 bytes */
+static int cmp_normalize(const char *s, int len, char *out)
+{
+    char line[CMP_LINE_MAX + 1], tmp[CMP_LINE_MAX + 1];
+    const char *p, *end, *q;
+    char *o;
+    regmatch_t m;
+    long long us;
+    int i, k, digit;
+
+    if (len > CMP_LINE_MAX)
+	len = CMP_LINE_MAX;
+    memcpy(line, s, len);
+    line[len] = '\0';
+
+    p = line;
+    end = line + len;
+    o = out;
+    if (cmp_defaults && (k = parse_timestamp(p, &us)) > 0)
+	p += k;
+
+    while (p < end)
+    {
+	unsigned char c = *p;
+
+	if (c == 0x1b)
+	{
+	    /* ESC [ parameters final, or ESC and one more */
+	    if (++p < end && *p == '[')
+		for (p++; p < end && !(*p >= 0x40 && *p <= 0x7e); p++)
+		    ;
+	    if (p < end)
+		p++;
+	    continue;
+	}
+	if ((c < 0x20 && c != '\t') || c == 0x7f)
+	{
+	    p++;
+	    continue;
+	}
+
+	if (cmp_defaults)
+	{
+	    int start = o == out || !isalnum((unsigned char)o[-1]);
+
+	    if (c == '[')
+	    {
+		for (q = p + 1; *q == ' '; q++)
+		    ;
+		for (i = 0; isdigit((unsigned char)q[i]); i++)
+		    ;
+		if (i && q[i] == '.' && isdigit((unsigned char)q[i + 1]))
+		{
+		    for (q += i + 1; isdigit((unsigned char)*q); q++)
+			;
+		    if (*q == ']')
+		    {
+			memcpy(o, "[#]", 3);
+			o += 3;
+			p = q + 1;
+			continue;
+		    }
+		}
+	    }
+
+	    if (start && c == '0' && (p[1] == 'x' || p[1] == 'X') && CMP_HEX(p[2]))
+	    {
+		for (p += 2; CMP_HEX(*p); p++)
+		    ;
+		memcpy(o, "0x#", 3);
+		o += 3;
+		continue;
+	    }
+
+	    if (start && CMP_HEX(c))
+	    {
+		for (i = digit = 0; CMP_HEX(p[i]); i++)
+		    digit |= isdigit((unsigned char)p[i]);
+		if (i >= 8 && digit && !isalnum((unsigned char)p[i]))
+		{
+		    *o++ = '#';
+		    p += i;
+		    continue;
+		}
+	    }
+	}
+
+	*o++ = *p++;
+    }
+
+    while (o > out && (o[-1] == ' ' || o[-1] == '\t'))
+	o--;
+    *o = '\0';
+
+    for (i = 0; i < cmp_nmasks; i++)
+    {
+	p = out;
+	o = tmp;
+	while (*p && regexec(&cmp_masks[i], p, 1, &m, p == out ? 0 : REG_NOTBOL) == 0)
+	{
+	    if (m.rm_eo == 0)
+	    {
+		/* an empty match, move on a character */
+		*o++ = *p++;
+		continue;
+	    }
+	    memcpy(o, p, m.rm_so);
+	    o += m.rm_so;
+	    if (m.rm_eo > m.rm_so)
+		*o++ = '#';
+	    p += m.rm_eo;
+	}
+	strcpy(o, p);
+	strcpy(out, tmp);
+	o = out + strlen(out);
+    }
+
+    return o - out;
+}
+
+static uint64_t cmp_hash(const char *s, int len)
+{
+    const uint64_t k = 0x9e3779b97f4a7c15ULL;
+    uint64_t h = len * k, w;
+
+    for (; len >= 8; s += 8, len -= 8)
+    {
+	memcpy(&w, s, 8);
+	h = (h ^ w) * k;
+	h ^= h >> 32;
+    }
+    w = 0;
+    memcpy(&w, s, len);
+    h = (h ^ w) * k;
+    h ^= h >> 29;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    return h ^ (h >> 32);
+}
+
+static int cmp_add_mask(const char *re)
+{
+    char msg[256];
+    int r;
+
+    if (cmp_nmasks == CMP_MASKS)
+    {
+	fprintf(stderr, "too many masks\n");
+	return -1;
+    }
+    if ((r = regcomp(&cmp_masks[cmp_nmasks], re, REG_EXTENDED)) != 0)
+    {
+	regerror(r, &cmp_masks[cmp_nmasks], msg, sizeof(msg));
+	fprintf(stderr, "mask \"%s\": %s\n", re, msg);
+	return -1;
+    }
+    cmp_nmasks++;
+    return 0;
+}
+
+static void cmp_free(struct cmp_file *f)
+{
+    if (!f)
+	return;
+    if (f->data)
+	munmap(f->data, f->size);
+    free(f->line);
+    free(f->lineno);
+    free(f->hash);
+    free(f->name);
+    free(f);
+}
+
+/* Map a log and hash its lines */
+static struct cmp_file *cmp_load(const char *name)
+{
+    struct cmp_file *f;
+    struct stat st;
+    char out[CMP_LINE_MAX + 1];
+    const char *p, *q, *end;
+    long lines, lineno;
+    int fd, k;
+
+    if ((fd = open(name, O_RDONLY)) == -1 || fstat(fd, &st) == -1)
+    {
+	fprintf(stderr, "failed to open \"%s\": %s\n", name, strerror(errno));
+	if (fd != -1)
+	    close(fd);
+	return NULL;
+    }
+
+    f = calloc(1, sizeof(*f));
+    f->name = strdup(name);
+    f->size = st.st_size;
+    if (f->size && (f->data = mmap(NULL, f->size, PROT_READ, MAP_PRIVATE,
+				   fd, 0)) == MAP_FAILED)
+    {
+	fprintf(stderr, "failed to map \"%s\": %s\n", name, strerror(errno));
+	f->data = NULL;
+	close(fd);
+	cmp_free(f);
+	return NULL;
+    }
+    close(fd);
+    if (f->size)
+	madvise(f->data, f->size, MADV_SEQUENTIAL);
+
+    end = f->data + f->size;
+    for (lines = 1, p = f->data; p < end && (p = memchr(p, '\n', end - p)); p++)
+	lines++;
+    f->line = malloc(lines * sizeof(*f->line));
+    f->lineno = malloc(lines * sizeof(*f->lineno));
+    f->hash = malloc(lines * sizeof(*f->hash));
+    if (!f->line || !f->lineno || !f->hash)
+    {
+	perror("malloc");
+	cmp_free(f);
+	return NULL;
+    }
+
+    for (p = f->data, lineno = 1; p < end; p = q + 1, lineno++)
+    {
+	if ((q = memchr(p, '\n', end - p)) == NULL)
+	    q = end;
+	if ((k = cmp_normalize(p, q - p, out)) == 0)
+	    continue;
+	f->line[f->n] = p - f->data;
+	f->lineno[f->n] = lineno;
+	f->hash[f->n++] = cmp_hash(out, k);
+    }
+
+    return f;
+}
+
+/* Print a line of a log as it is, without the line end */
+static void cmp_print(FILE *fp, const char *prefix, struct cmp_file *f, long i)
+{
+    const char *p = f->data + f->line[i];
+    const char *q = memchr(p, '\n', f->data + f->size - p);
+    int len = (q ? q : f->data + f->size) - p;
+
+    if (len && p[len - 1] == '\r')
+	len--;
+    fprintf(fp, "%s%.*s\n", prefix, len, p);
+}
+
+/* Following the received data */
+
+static struct cmp_file *cmp_golden;
+static long cmp_pos;			/* next expected golden line */
+static char cmp_line[CMP_LINE_MAX];
+static int cmp_line_len;
+static unsigned long cmp_matched, cmp_unexpected, cmp_missing;
+
+static void cmp_report(const char *what, struct cmp_file *f, long i,
+		       const char *s, int len)
+{
+    char msg[CMP_LINE_MAX + 128];
+    const char *q;
+    int n;
+
+    if (f)
+    {
+	s = f->data + f->line[i];
+	q = memchr(s, '\n', f->data + f->size - s);
+	len = (q ? q : f->data + f->size) - s;
+    }
+    while (len && (s[len - 1] == '\r' || s[len - 1] == '\n'))
+	len--;
+
+    n = snprintf(msg, sizeof(msg), "%s[golden] %s: %.*s\r\n",
+		 rx_bol ? "" : "\r\n", what, len, s);
+    out_write(msg, n < sizeof(msg) ? n : sizeof(msg) - 1);
+}
+
+static void cmp_rx_line(const char *s, int len)
+{
+    char out[CMP_LINE_MAX + 1];
+    char what[64];
+    uint64_t h;
+    long k;
+    int n;
+
+    if ((n = cmp_normalize(s, len, out)) == 0)
+	return;
+    h = cmp_hash(out, n);
+
+    if (cmp_pos < cmp_golden->n && cmp_golden->hash[cmp_pos] == h)
+    {
+	cmp_pos++;
+	cmp_matched++;
+	return;
+    }
+
+    for (k = 1; k < CMP_WINDOW && cmp_pos + k < cmp_golden->n; k++)
+	if (cmp_golden->hash[cmp_pos + k] == h)
+	    break;
+
+    if (k < CMP_WINDOW && cmp_pos + k < cmp_golden->n)
+    {
+	snprintf(what, sizeof(what), "%ld line%s missing, golden line %ld",
+		 k, k == 1 ? "" : "s", cmp_golden->lineno[cmp_pos]);
+	cmp_report(what, cmp_golden, cmp_pos, NULL, 0);
+	cmp_missing += k;
+	cmp_pos += k + 1;
+	cmp_matched++;
+    }
+    else
+    {
+	cmp_report("unexpected", NULL, 0, s, len);
+	cmp_unexpected++;
+    }
+}
+
+/* Split received data into lines and follow them in the golden log */
+static void cmp_data(const char *buf, int n)
+{
+    const char *p = buf, *q, *end = buf + n;
+    int k;
+
+    while (p < end)
+    {
+	if ((q = memchr(p, '\n', end - p)) == NULL)
+	    q = end;
+	k = q - p < CMP_LINE_MAX - cmp_line_len ? q - p : CMP_LINE_MAX - cmp_line_len;
+	memcpy(cmp_line + cmp_line_len, p, k);
+	cmp_line_len += k;
+	if (q == end)
+	    break;
+	cmp_rx_line(cmp_line, cmp_line_len);
+	cmp_line_len = 0;
+	p = q + 1;
+    }
+}
+
+static void cmp_stop(void)
+{
+    if (!cmp_golden)
+	return;
+
+    printf("golden: %lu lines matched, %lu unexpected, %lu missing, "
+	   "%ld golden lines not reached\n",
+	   cmp_matched, cmp_unexpected, cmp_missing, cmp_golden->n - cmp_pos);
+    cmp_free(cmp_golden);
+    cmp_golden = NULL;
+}
+
+/************************************************************************/
+
+/* Show received data and pass it on, to the log too unless it is
+   there already */
+static int rx_deliver(char *buf, int n, int logged)
+{
+    if (framing != framings)
+    {
+	if (frame_rx((unsigned char *)buf, n) == -1)
+	{
+	    perror("write stdout");
+	    return -1;
+	}
+	rx_bol = frame_bol;
+    }
+    else if (rx_show(buf, n) == -1)
+    {
+	perror("write stdout");
+	return -1;
+    }
+    else
+	rx_bol = buf[n - 1] == '\n';
+    if (!logged)
+	log_data(buf, n);
+    if (flag_hex)
+	rx_hex(buf, n);
+    if (cmp_golden)
+	cmp_data(buf, n);
+
+    return 0;
+}
+
+/* Handle data received from the port */
+static int rx_data(char *buf, int n)
+{
+    int k;
+
+    pty_output(buf, n);
+
+    if (cap_name && (k = cap_data(buf, n)) > 0)
+    {
+	log_data(buf, k);
+	buf += k;
+	n -= k;
+    }
+    if (cap_ending)
+	cap_done();
+
+    /* the start of the pattern was held back from an earlier chunk */
+    if (cap_rest_len)
+    {
+	k = cap_rest_len;
+	cap_rest_len = 0;
+	if (rx_deliver(cap_rest, k, 1) == -1)
+	    return -1;
+    }
+
+    if (n == 0)
+	return 0;
+    return rx_deliver(buf, n, 0);
+}
+
+/************************************************************************/
+
+/* Modem line sequences.  A sequence is a list of DTR/RTS changes,
+   breaks and waits.  Line changes between two waits are applied with
+   a single TIOCMSET, and waits are absolute timerfd deadlines counted
+   from the start of the sequence so that errors do not add up.  In
+   the connect loop the timerfd is watched by select(), at the command
+   prompt seq_wait() keeps receiving while the sequence runs, so the
+   output of a target that is being reset is never missed. */
+
+enum { SEQ_SET, SEQ_CLEAR, SEQ_BREAK_ON, SEQ_BREAK_OFF, SEQ_WAIT };
+
+#define SEQ_MAX		64
+
+struct seq_step
+{
+    int op;
+    long arg;			/* TIOCM_ bit or microseconds */
+};
+
+static char *seq_stored;
+static struct seq_step seq_steps[SEQ_MAX];
+static int seq_len;
+static int seq_pos;
+static int seq_active;
+static int seq_fd = -1;
+static long long seq_deadline;
+
+/* Steps beyond SEQ_MAX are counted but not stored */
+static void seq_add(int op, long arg)
+{
+    if (seq_len < SEQ_MAX)
+    {
+	seq_steps[seq_len].op = op;
+	seq_steps[seq_len].arg = arg;
+    }
+    seq_len++;
+}
+
+/* Parse "dtr on|off", "rts on|off", "break <ms>", "wait <ms>" and
+   "pulse dtr|rts|break <ms>" steps */
+static int seq_parse(const char *s)
+{
+    char buf[1024];
+    char *tok, *val, *p;
+    long bit;
+    double ms;
+
+    if (strlen(s) >= sizeof(buf))
+	return -1;
+    strcpy(buf, s);
+
+    seq_len = 0;
+    for (tok = strtok(buf, " \t,"); tok; tok = strtok(NULL, " \t,"))
+    {
+	int pulse = strcasecmp(tok, "pulse") == 0;
+
+	if (pulse && (tok = strtok(NULL, " \t,")) == NULL)
+	    return -1;
+	if ((val = strtok(NULL, " \t,")) == NULL)
+	    return -1;
+
+	bit = 0;
+	if (strcasecmp(tok, "dtr") == 0)
+	    bit = TIOCM_DTR;
+	else if (strcasecmp(tok, "rts") == 0)
+	    bit = TIOCM_RTS;
+
+	if (bit && !pulse)
+	{
+	    if (strcasecmp(val, "on") == 0)
+		seq_add(SEQ_SET, bit);
+	    else if (strcasecmp(val, "off") == 0)
+		seq_add(SEQ_CLEAR, bit);
+	    else
+		return -1;
+	    continue;
+	}
+
+	ms = strtod(val, &p);
+	if (*p || ms < 0)
+	    return -1;
+
+	if (bit)
+	{
+	    seq_add(SEQ_SET, bit);
+	    seq_add(SEQ_WAIT, ms * 1000);
+	    seq_add(SEQ_CLEAR, bit);
+	}
+	else if (strcasecmp(tok, "break") == 0)
+	{
+	    seq_add(SEQ_BREAK_ON, 0);
+	    seq_add(SEQ_WAIT, ms * 1000);
+	    seq_add(SEQ_BREAK_OFF, 0);
+	}
+	else if (strcasecmp(tok, "wait") == 0 && !pulse)
+	    seq_add(SEQ_WAIT, ms * 1000);
+	else
+	    return -1;
+    }
+
+    return seq_len > SEQ_MAX ? -1 : 0;
+}
+
+static int seq_lines(int *set, int *clear)
+{
+    int flags;
+
+    if (!*set && !*clear)
+	return 0;
+
+    if (ioctl(term_fd, TIOCMGET, &flags) == -1)
+    {
+	perror("TIOCMGET");
+	return -1;
+    }
+    flags = (flags | *set) & ~*clear;
+    if (ioctl(term_fd, TIOCMSET, &flags) == -1)
+    {
+	perror("TIOCMSET");
+	return -1;
+    }
+
+    *set = *clear = 0;
+    return 0;
+}
+
+/* Run the sequence until it has to wait or is done */
+static int seq_run(void)
+{
+    struct itimerspec its;
+    struct seq_step *step;
+    int set = 0, clear = 0;
+
+    for (; seq_pos < seq_len; seq_pos++)
+    {
+	step = &seq_steps[seq_pos];
+
+	switch (step->op)
+	{
+	case SEQ_SET:
+	    set |= step->arg;
+	    clear &= ~step->arg;
+	    break;
+
+	case SEQ_CLEAR:
+	    clear |= step->arg;
+	    set &= ~step->arg;
+	    break;
+
+	case SEQ_BREAK_ON:
+	case SEQ_BREAK_OFF:
+	    if (seq_lines(&set, &clear) == -1)
+		goto fail;
+	    if (ioctl(term_fd, step->op == SEQ_BREAK_ON ? TIOCSBRK : TIOCCBRK) == -1)
+	    {
+		perror("break");
+		goto fail;
+	    }
+	    break;
+
+	case SEQ_WAIT:
+	    if (seq_lines(&set, &clear) == -1)
+		goto fail;
+	    seq_deadline += step->arg;
+	    memset(&its, 0, sizeof(its));
+	    its.it_value.tv_sec = seq_deadline / 1000000;
+	    its.it_value.tv_nsec = seq_deadline % 1000000 * 1000;
+	    /* a zero it_value would disarm the timer */
+	    if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+		its.it_value.tv_nsec = 1;
+	    if (timerfd_settime(seq_fd, TFD_TIMER_ABSTIME, &its, NULL) == -1)
+	    {
+		perror("timerfd_settime");
+		goto fail;
+	    }
+	    seq_pos++;
+	    return 0;
+	}
+    }
+
+    if (seq_lines(&set, &clear) == -1)
+	goto fail;
+    seq_active = 0;
+    return 0;
+
+fail:
+    ioctl(term_fd, TIOCCBRK);
+    seq_active = 0;
+    return -1;
+}
+
+static int seq_start(const char *s)
+{
+    if (term_fd == -1)
+    {
+	printf("No port selected\n");
+	return -1;
+    }
+
+    /* the steps of the running sequence would be overwritten */
+    if (seq_active)
+    {
+	fprintf(stderr, "A sequence is already running\n");
+	return -1;
+    }
+
+    if (seq_parse(s) == -1)
+    {
+	fprintf(stderr, "Invalid sequence \"%s\"\n", s);
+	return -1;
+    }
+
+    if (seq_fd == -1 &&
+	(seq_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1)
+    {
+	perror("timerfd_create");
+	return -1;
+    }
+
+    seq_pos = 0;
+    seq_active = 1;
+    seq_deadline = now_us();
+
+    return seq_run();
+}
+
+/* Called when the sequence timerfd is readable */
+static int seq_timer(void)
+{
+    unsigned long long expirations;
+
+    if (read(seq_fd, &expirations, sizeof(expirations)) <= 0)
+	return 0;
+    return seq_run();
+}
+
+/* Run a sequence to the end while passing on received data */
+static int seq_wait(void)
+{
+    fd_set readfds;
+    char buf[1024];
+    int n;
+
+    while (seq_active)
+    {
+	FD_ZERO(&readfds);
+	FD_SET(seq_fd, &readfds);
+	FD_SET(term_fd, &readfds);
+
+	if (select((seq_fd > term_fd ? seq_fd : term_fd) + 1,
+		   &readfds, NULL, NULL, NULL) < 0)
+	{
+	    perror("select");
+	    return -1;
+	}
+
+	if (FD_ISSET(term_fd, &readfds) &&
+	    (n = read(term_fd, buf, sizeof(buf))) > 0)
+	    rx_data(buf, n);
+
+	if (FD_ISSET(seq_fd, &readfds) && seq_timer() == -1)
+	    return -1;
+    }
+
+    return 0;
+}
+
+/************************************************************************/
+
+/* Modem status monitor.  A helper thread sleeps in TIOCMIWAIT and
+   passes each change of CTS, DSR, DCD or RI to the connect loop over
+   a pipe, stamped with the time it was seen.  The kernel interrupt
+   counters are read too, so transitions that are too short to show
+   up in TIOCMGET are still counted.  The thread is stopped by
+   interrupting the ioctl with SIGUSR1. */
+
+#define MON_LINES	(TIOCM_CTS | TIOCM_DSR | TIOCM_CD | TIOCM_RI)
+
+struct mon_event
+{
+    struct timeval tv;
+    int status;
+    int err;
+    int have_icount;
+    struct serial_icounter_struct icount;
+};
+
+static const struct
+{
+    const char *name;
+    int bit;
+    size_t icount;		/* offset of the interrupt counter */
+} mon_lines[] =
+{
+    { "CTS", TIOCM_CTS, offsetof(struct serial_icounter_struct, cts) },
+    { "DSR", TIOCM_DSR, offsetof(struct serial_icounter_struct, dsr) },
+    { "DCD", TIOCM_CD, offsetof(struct serial_icounter_struct, dcd) },
+    { "RI", TIOCM_RI, offsetof(struct serial_icounter_struct, rng) },
+};
+
+#define ICOUNT(ic, i)	(*(int *)((char *)(ic) + mon_lines[i].icount))
+
+static pthread_t mon_thread;
+static int mon_running;
+static volatile sig_atomic_t mon_stop;
+static int mon_pipe[2] = { -1, -1 };
+static int mon_status;
+static struct serial_icounter_struct mon_icount;
+static unsigned long mon_counts[4];
+
+static void mon_signal(int sig)
+{
+}
+
+static int mon_read(int fd, struct mon_event *ev)
+{
+    memset(ev, 0, sizeof(*ev));
+    gettimeofday(&ev->tv, NULL);
+    if (ioctl(fd, TIOCMGET, &ev->status) == -1)
+	return -1;
+    ev->have_icount = ioctl(fd, TIOCGICOUNT, &ev->icount) == 0;
+    return 0;
+}
+
+static void *mon_main(void *arg)
+{
+    int fd = (long)arg;
+    struct mon_event ev;
+
+    while (!mon_stop)
+    {
+	if (ioctl(fd, TIOCMIWAIT, MON_LINES) == -1 || mon_read(fd, &ev) == -1)
+	{
+	    if (errno == EINTR)
+		continue;
+	    memset(&ev, 0, sizeof(ev));
+	    ev.err = errno;
+	    write(mon_pipe[1], &ev, sizeof(ev));
+	    break;
+	}
+	write(mon_pipe[1], &ev, sizeof(ev));
+    }
+
+    close(fd);
+    return NULL;
+}
+
+static void mon_start(void)
+{
+    struct sigaction sa;
+    struct mon_event ev;
+    int fd;
+
+    if (!flag_monitor || mon_running || term_fd == -1)
+	return;
+
+    if (mon_pipe[0] == -1 && pipe2(mon_pipe, O_CLOEXEC) == -1)
+    {
+	perror("pipe");
+	return;
+    }
+
+    /* no SA_RESTART, the signal must interrupt TIOCMIWAIT */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = mon_signal;
+    sigaction(SIGUSR1, &sa, NULL);
+
+    if ((fd = dup(term_fd)) == -1 || mon_read(fd, &ev) == -1)
+    {
+	perror("modem monitor");
+	if (fd != -1)
+	    close(fd);
+	return;
+    }
+    mon_status = ev.status;
+    mon_icount = ev.icount;
+
+    mon_stop = 0;
+    if (pthread_create(&mon_thread, NULL, mon_main, (void *)(long)fd) != 0)
+    {
+	perror("pthread_create");
+	close(fd);
+	return;
+    }
+    mon_running = 1;
+}
+
+static void mon_halt(void)
+{
+    struct timespec ts;
+    struct mon_event ev;
+
+    if (!mon_running)
+	return;
+
+    /* the signal can arrive just before the thread enters the ioctl,
+       so keep sending it until the thread is gone */
+    mon_stop = 1;
+    do
+    {
+	pthread_kill(mon_thread, SIGUSR1);
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec += 10000000;
+	if (ts.tv_nsec >= 1000000000)
+	{
+	    ts.tv_sec++;
+	    ts.tv_nsec -= 1000000000;
+	}
+    } while (pthread_timedjoin_np(mon_thread, NULL, &ts) == ETIMEDOUT);
+    mon_running = 0;
+
+    /* drop events that were not handled */
+    fcntl(mon_pipe[0], F_SETFL, O_NONBLOCK);
+    while (read(mon_pipe[0], &ev, sizeof(ev)) > 0)
+	;
+    fcntl(mon_pipe[0], F_SETFL, 0);
+}
+
+/* Report an event from the monitor thread */
+static int mon_event(void)
+{
+    struct mon_event ev;
+    struct tm tm;
+    char s[256];
+    unsigned long delta;
+    int changed;
+    int i, k;
+
+    if (read(mon_pipe[0], &ev, sizeof(ev)) != sizeof(ev))
+	return 0;
+
+    if (ev.err)
+    {
+	k = snprintf(s, sizeof(s), "%s[modem monitor stopped: %s]\r\n",
+		     rx_bol ? "" : "\r\n", strerror(ev.err));
+	/* only the thread stops, it is started again when the port is
+	   reopened */
+	pthread_join(mon_thread, NULL);
+	mon_running = 0;
+	return out_write(s, k);
+    }
+
+    k = rx_bol ? 0 : sprintf(s, "\r\n");
+    localtime_r(&ev.tv.tv_sec, &tm);
+    k += strftime(s + k, sizeof(s) - k, "[modem %H:%M:%S", &tm);
+    k += sprintf(s + k, ".%06ld", (long)ev.tv.tv_usec);
+
+    for (i = 0; i < 4; i++)
+    {
+	changed = (ev.status ^ mon_status) & mon_lines[i].bit;
+	if (ev.have_icount)
+	    delta = ICOUNT(&ev.icount, i) - ICOUNT(&mon_icount, i);
+	else
+	    delta = changed != 0;
+
+	if (delta == 0 && !changed)
+	    continue;
+
+	mon_counts[i] += delta;
+	k += sprintf(s + k, " %s %s", mon_lines[i].name,
+		     ev.status & mon_lines[i].bit ? "on" : "off");
+	if (delta > 1)
+	    k += sprintf(s + k, " (%lu changes)", delta);
+    }
+    k += sprintf(s + k, "]\r\n");
+
+    mon_status = ev.status;
+    if (ev.have_icount)
+	mon_icount = ev.icount;
+
+    log_data(s, k);
+    rx_bol = 1;
+    return out_write(s, k);
+}
+
+/************************************************************************/
+
+/* Pty passthrough.  "set pty" creates a pseudo-terminal that mirrors
+   the port, so that a flashing tool or gdb can use the port while tt
+   keeps showing and logging what comes in.  Received data is copied
+   to the pty before anything else is done with it, and what the pty
+   client writes goes to the port as it is, without translation or
+   echo.  tt keeps the slave side open itself, so the client can come
+   and go.  What nobody reads would wait there for the next client, so
+   the slave input is flushed once it has not gone down for
+   PTY_STALE_MS.  In exclusive mode the keyboard and the control socket can
+   not send to the port while the client is writing, and until it has
+   been quiet for the hold time. */
+
+#define PTY_HOLD_MS	1000
+#define PTY_STALE_MS	1000
+
+static int pty_fd = -1;			/* master side */
+static int pty_slave = -1;
+static char *pty_name;
+static char *pty_link;
+static int pty_exclusive;
+static long pty_hold_ms = PTY_HOLD_MS;
+static long long pty_last_us;		/* when the client last wrote */
+static int pty_queued;			/* unread input of the slave */
+static long long pty_read_us;		/* when that last went down */
+static unsigned long long pty_in, pty_out, pty_dropped;
+
+static void pty_close(void)
+{
+    if (pty_fd == -1)
+	return;
+
+    close(pty_fd);
+    close(pty_slave);
+    pty_fd = pty_slave = -1;
+    if (pty_link)
+	unlink(pty_link);
+    free(pty_link);
+    free(pty_name);
+    pty_link = pty_name = NULL;
+}
+
+static int pty_open(const char *link)
+{
+    struct termios termios;
+    struct stat st;
+    char *name;
+
+    pty_close();
+
+    if ((pty_fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC)) == -1 ||
+	grantpt(pty_fd) == -1 || unlockpt(pty_fd) == -1 ||
+	(name = ptsname(pty_fd)) == NULL ||
+	(pty_slave = open(name, O_RDWR | O_NOCTTY | O_CLOEXEC)) == -1)
+    {
+	perror("pty");
+	goto fail;
+    }
+
+    tcgetattr(pty_slave, &termios);
+    cfmakeraw(&termios);
+    tcsetattr(pty_slave, TCSANOW, &termios);
+
+    if (link)
+    {
+	/* replace a link left behind by an earlier tt */
+	if (lstat(link, &st) == 0 && S_ISLNK(st.st_mode))
+	    unlink(link);
+	if (symlink(name, link) == -1)
+	{
+	    fprintf(stderr, "failed to create \"%s\": %s\n", link, strerror(errno));
+	    goto fail;
+	}
+	pty_link = strdup(link);
+    }
+
+    pty_name = strdup(name);
+    pty_in = pty_out = pty_dropped = 0;
+    pty_last_us = 0;
+    pty_queued = 0;
+    pty_read_us = now_us();
+
+    return 0;
+
+fail:
+    if (pty_slave != -1)
+	close(pty_slave);
+    if (pty_fd != -1)
+	close(pty_fd);
+    pty_fd = pty_slave = -1;
+    return -1;
+}
+
+/* Returns 1 if the pty client has the port to itself */
+static int pty_busy(void)
+{
+    return pty_exclusive && pty_last_us
+	&& now_us() - pty_last_us < pty_hold_ms * 1000LL;
+}
+
+/* Drop what has been waiting on the slave with no client reading it */
+static void pty_stale(void)
+{
+    long long now = now_us();
+    int q;
+
+    if (ioctl(pty_slave, TIOCINQ, &q) == -1)
+	return;
+
+    if (q == 0 || q < pty_queued)
+	pty_read_us = now;
+    else if (now - pty_read_us >= PTY_STALE_MS * 1000LL)
+    {
+	tcflush(pty_slave, TCIFLUSH);
+	pty_dropped += q;
+	pty_read_us = now;
+	q = 0;
+    }
+    pty_queued = q;
+}
+
+/* Pass received data on to the pty client.  If the client does not
+   keep up the data is dropped rather than holding up the port. */
+static void pty_output(const char *buf, int n)
+{
+    int r;
+
+    if (pty_fd == -1)
+	return;
+
+    pty_stale();
+    if ((r = write(pty_fd, buf, n)) < 0)
+	r = 0;
+    pty_out += r;
+    pty_dropped += n - r;
+}
+
+static void pty_watch(fd_set *readfds, int *fd_limit)
+{
+    if (pty_fd != -1)
+	pty_stale();
+    if (pty_fd != -1 && term_fd != -1 && tx_space())
+	fd_watch(pty_fd, readfds, fd_limit);
+}
+
+static int pty_poll(fd_set *readfds)
+{
+    char buf[4096];
+    int n;
+
+    if (pty_fd == -1 || term_fd == -1 || !FD_ISSET(pty_fd, readfds))
+	return 0;
+
+    n = tx_space() < sizeof(buf) ? tx_space() : sizeof(buf);
+    if ((n = read(pty_fd, buf, n)) <= 0)
+	return 0;
+
+    pty_in += n;
+    pty_last_us = now_us();
+    return tx_put(buf, n);
+}
+
+/************************************************************************/
+
+/* Control socket.  While connected, other processes can connect to a
+   unix domain socket and send commands and data to inject into the
+   port.  Every message is a type byte and a 32 bit big endian length
+   followed by the payload:
+
+       'C' <command>	run a command as if typed at the prompt
+       'D' <data>	send data to the port
+       'S'		attach, replay the history and then pass on
+			everything shown as 'O' <data> messages
+
+   and every message is acknowledged with an 'A' message with a one
+   byte payload, 1 for success and 0 for failure.  Messages can be
+   sent back to back without waiting, all complete messages that have
+   been received are handled together and their acknowledgements are
+   sent with a single write. */
+
+#define CTL_CLIENTS	16
+#define CTL_HDR		5
+#define CTL_MAX		65536
+#define CTL_BACKLOG	(4 << 20)
+
+struct ctl_client
+{
+    int fd;
+    int attached;
+    unsigned char *in;
+    int in_len;
+    unsigned char *out;
+    int out_len;
+    int out_size;
+    int broken;			/* a reply was lost, drop the client */
+};
+
+static char *ctl_path;
+static int ctl_fd = -1;
+static struct ctl_client ctl_clients[CTL_CLIENTS];
+static int in_connect;
+static int ctl_handling;		/* running a command from a client */
+static unsigned long ctl_messages;
+
+static void ctl_drop(struct ctl_client *cl)
+{
+    close(cl->fd);
+    free(cl->in);
+    free(cl->out);
+    memset(cl, 0, sizeof(*cl));
+    cl->fd = -1;
+}
+
+static void ctl_close(void)
+{
+    int i;
+
+    if (ctl_fd == -1)
+	return;
+
+    for (i = 0; i < CTL_CLIENTS; i++)
+	if (ctl_clients[i].fd != -1)
+	    ctl_drop(&ctl_clients[i]);
+
+    close(ctl_fd);
+    ctl_fd = -1;
+    unlink(ctl_path);
+    free(ctl_path);
+    ctl_path = NULL;
+    setenv("TT_CONTROL", "", 1);
+}
+
+static int ctl_open(const char *path)
+{
+    struct sockaddr_un sa;
+    struct stat st;
+    int i;
+
+    if (strlen(path) >= sizeof(sa.sun_path))
+    {
+	fprintf(stderr, "control socket path too long\n");
+	return -1;
+    }
+
+    ctl_close();
+
+    /* remove a socket left behind by an earlier tt */
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+	unlink(path);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strcpy(sa.sun_path, path);
+
+    if ((ctl_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1 ||
+	bind(ctl_fd, (struct sockaddr *)&sa, sizeof(sa)) == -1 ||
+	listen(ctl_fd, CTL_CLIENTS) == -1)
+    {
+	fprintf(stderr, "failed to create control socket \"%s\": %s\n",
+		path, strerror(errno));
+	if (ctl_fd != -1)
+	    close(ctl_fd);
+	ctl_fd = -1;
+	return -1;
+    }
+
+    for (i = 0; i < CTL_CLIENTS; i++)
+	ctl_clients[i].fd = -1;
+
+    ctl_path = strdup(path);
+    setenv("TT_CONTROL", path, 1);
+
+    return 0;
+}
+
+/* Queue a message for a client.  Without memory for it the client is
+   marked broken, it can be in use by ctl_handle() so ctl_poll() drops
+   it later. */
+static void ctl_reply(struct ctl_client *cl, int type, const void *buf, int len)
+{
+    uint32_t n = htonl(len);
+    unsigned char *out;
+
+    if (cl->broken)
+	return;
+
+    if (cl->out_len + CTL_HDR + len > cl->out_size)
+    {
+	if ((out = realloc(cl->out, (cl->out_len + CTL_HDR + len) * 2)) == NULL)
+	{
+	    cl->broken = 1;
+	    return;
+	}
+	cl->out = out;
+	cl->out_size = (cl->out_len + CTL_HDR + len) * 2;
+    }
+
+    cl->out[cl->out_len] = type;
+    memcpy(cl->out + cl->out_len + 1, &n, 4);
+    memcpy(cl->out + cl->out_len + CTL_HDR, buf, len);
+    cl->out_len += CTL_HDR + len;
+}
+
+/* Send the end of the scrollback to a client that attaches */
+static void ctl_history(struct ctl_client *cl)
+{
+    size_t len;
+    char *p = hist_data(&len);
+
+    if (len > HISTORY_REPLAY)
+    {
+	p += len - HISTORY_REPLAY;
+	len = HISTORY_REPLAY;
+    }
+    if (len)
+	ctl_reply(cl, 'O', p, len);
+}
+
+/* Pass output on to attached clients.  A client that can not keep up
+   is dropped by ctl_poll() rather than blocking the port. */
+static void ctl_output(const void *buf, int n)
+{
+    struct ctl_client *cl;
+    int i;
+
+    if (ctl_fd == -1)
+	return;
+
+    for (i = 0; i < CTL_CLIENTS; i++)
+    {
+	cl = &ctl_clients[i];
+	if (cl->fd != -1 && cl->attached && cl->out_len <= CTL_BACKLOG)
+	    ctl_reply(cl, 'O', buf, n);
+    }
+}
+
+static void ctl_flush(struct ctl_client *cl)
+{
+    int n;
+
+    if (cl->out_len == 0)
+	return;
+
+    if ((n = send(cl->fd, cl->out, cl->out_len, MSG_NOSIGNAL)) < 0)
+    {
+	if (errno != EAGAIN)
+	    ctl_drop(cl);
+	return;
+    }
+    memmove(cl->out, cl->out + n, cl->out_len - n);
+    cl->out_len -= n;
+}
+
+/* Handle all complete messages from a client */
+/* Returns -1 if the client sent a message that can never fit */
+static int ctl_handle(struct ctl_client *cl, int *tty_restored)
+{
+    unsigned char *p = cl->in;
+    unsigned char *end = cl->in + cl->in_len;
+    char cmd[256];
+    unsigned char status;
+    uint32_t len;
+
+    while (end - p >= CTL_HDR)
+    {
+	memcpy(&len, p + 1, 4);
+	len = ntohl(len);
+	if (len > CTL_MAX)
+	    return -1;
+	if (end - p < CTL_HDR + len)
+	    break;
+
+	switch (p[0])
+	{
+	case 'C':
+	    /* commands print to the terminal, so restore it only once
+	       for a whole batch of commands */
+	    if (!*tty_restored)
+	    {
+		restore_tty();
+		*tty_restored = 1;
+	    }
+	    /* a cut command could do something else than asked */
+	    if (len >= sizeof(cmd))
+	    {
+		status = 0;
+		break;
+	    }
+	    memcpy(cmd, p + CTL_HDR, len);
+	    cmd[len] = '\0';
+	    ctl_handling = 1;
+	    status = handle(cmd) != 0;
+	    ctl_handling = 0;
+	    break;
+
+	case 'D':
+	    status = term_fd != -1 && !pty_busy()
+		&& tx_data((char *)p + CTL_HDR, len) == 0;
+	    break;
+
+	case 'S':
+	    status = 1;
+	    ctl_reply(cl, 'A', &status, 1);
+	    ctl_history(cl);
+	    cl->attached = 1;
+	    ctl_messages++;
+	    p += CTL_HDR + len;
+	    continue;
+
+	default:
+	    status = 0;
+	    break;
+	}
+
+	ctl_reply(cl, 'A', &status, 1);
+	ctl_messages++;
+	p += CTL_HDR + len;
+    }
+
+    memmove(cl->in, p, end - p);
+    cl->in_len = end - p;
+    return 0;
+}
+
+static void ctl_watch(fd_set *readfds, fd_set *writefds, int *fd_limit)
+{
+    int i;
+
+    if (ctl_fd == -1)
+	return;
+
+    fd_watch(ctl_fd, readfds, fd_limit);
+    for (i = 0; i < CTL_CLIENTS; i++)
+    {
+	if (ctl_clients[i].fd == -1)
+	    continue;
+	fd_watch(ctl_clients[i].fd, readfds, fd_limit);
+	if (ctl_clients[i].out_len)
+	    fd_watch(ctl_clients[i].fd, writefds, fd_limit);
+    }
+}
+
+static void ctl_poll(fd_set *readfds)
+{
+    struct ctl_client *cl;
+    int tty_restored = 0;
+    int fd, i, n;
+
+    if (ctl_fd == -1)
+	return;
+
+    if (FD_ISSET(ctl_fd, readfds) &&
+	(fd = accept4(ctl_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1)
+    {
+	for (i = 0; i < CTL_CLIENTS && ctl_clients[i].fd != -1; i++)
+	    ;
+	if (i == CTL_CLIENTS || (ctl_clients[i].in = malloc(CTL_HDR + CTL_MAX)) == NULL)
+	    close(fd);
+	else
+	    ctl_clients[i].fd = fd;
+    }
+
+    for (i = 0; i < CTL_CLIENTS; i++)
+    {
+	cl = &ctl_clients[i];
+
+	if (cl->fd != -1 && FD_ISSET(cl->fd, readfds))
+	{
+	    n = read(cl->fd, cl->in + cl->in_len, CTL_HDR + CTL_MAX - cl->in_len);
+	    if (n == 0 || (n < 0 && errno != EAGAIN))
+	    {
+		ctl_drop(cl);
+		continue;
+	    }
+	    if (n > 0)
+		cl->in_len += n;
+
+	    if (ctl_handle(cl, &tty_restored) == -1)
+	    {
+		ctl_drop(cl);
+		continue;
+	    }
+	}
+
+	if (cl->fd != -1 && cl->out_len)
+	    ctl_flush(cl);
+	if (cl->fd != -1 && (cl->broken || cl->out_len > CTL_BACKLOG))
+	    ctl_drop(cl);
+    }
+
+    if (tty_restored)
+    {
+	fflush(stdout);
+	setup_tty();
+    }
+}
+
+/************************************************************************/
+
+/* io_uring backend for the connect loop, enabled with "set uring on".
+   A multishot read stays posted on the port, taking buffers from a
+   provided buffer ring, so data arrives without a read() per chunk.
+   Log writes are gathered into registered buffers and submitted once
+   per pass of the loop as WRITE_FIXED requests at explicit offsets.
+   select() still does the waiting, with the ring in its read set.  Without
+   multishot reads (before Linux 6.7) the port is read as before, and
+   without io_uring the loop is unchanged.  The system calls are made
+   directly, liburing is not needed. */
+
+#define URING_ENTRIES		64
+#define URING_RX_BUFS		16	/* a power of two */
+#define URING_RX_SIZE		4096
+#define URING_LOG_BUFS		4
+#define URING_LOG_SIZE		65536
+#define URING_OP_READ_MULTISHOT	49	/* missing from older headers */
+
+enum { URING_RX = 1, URING_LOG };	/* user_data >> 8 */
+
+static int flag_uring;
+
+static struct
+{
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    unsigned sq_entries;
+    unsigned to_submit;
+} uring = { -1 };
+
+static int uring_rx;			/* the port is read through the ring */
+static int uring_rx_armed;
+static struct io_uring_buf_ring *uring_rx_ring;
+static unsigned short uring_rx_tail;
+static char *uring_rx_bufs;
+static struct { int res; unsigned flags; } uring_rx_queue[2 * URING_RX_BUFS];
+static unsigned uring_rx_head, uring_rx_tail_q;	/* completions not yet handled */
+
+static char *uring_log_bufs;
+static int uring_log_len[URING_LOG_BUFS];
+static int uring_log_busy[URING_LOG_BUFS];
+static int uring_log_done_len[URING_LOG_BUFS];	/* written so far */
+static off_t uring_log_off[URING_LOG_BUFS];
+static int uring_log_cur;
+static int uring_log_inflight;
+static off_t uring_log_at;		/* where the next write goes */
+static int uring_log_flags = -1;	/* of log_fd, -1 until first write */
+
+static struct
+{
+    unsigned long enters;
+    unsigned long reads;
+    unsigned long writes;
+} uring_stats;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+			      unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+		   NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned op, void *arg, unsigned n)
+{
+    return syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+static struct io_uring_sqe *uring_sqe(void)
+{
+    struct io_uring_sqe *sqe;
+    unsigned tail = *uring.sq_tail;
+    unsigned i = tail & *uring.sq_mask;
+
+    sqe = &uring.sqes[i];
+    memset(sqe, 0, sizeof(*sqe));
+    uring.sq_array[i] = i;
+    __atomic_store_n(uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    uring.to_submit++;
+    return sqe;
+}
+
+/* Submit what is queued, and wait for a completion if asked to */
+static int uring_enter(int wait)
+{
+    int r;
+
+    do
+	r = sys_io_uring_enter(uring.fd, uring.to_submit, wait,
+			       wait ? IORING_ENTER_GETEVENTS : 0);
+    while (r == -1 && errno == EINTR);
+
+    uring_stats.enters++;
+    if (r > 0)
+	uring.to_submit -= r;
+    return r;
+}
+
+static void uring_rx_give(int bid)
+{
+    struct io_uring_buf *b = &uring_rx_ring->bufs[uring_rx_tail & (URING_RX_BUFS - 1)];
+
+    b->addr = (unsigned long)(uring_rx_bufs + bid * URING_RX_SIZE);
+    b->len = URING_RX_SIZE;
+    b->bid = bid;
+    __atomic_store_n(&uring_rx_ring->tail, ++uring_rx_tail, __ATOMIC_RELEASE);
+}
+
+static void uring_rx_arm(void)
+{
+    struct io_uring_sqe *sqe = uring_sqe();
+
+    sqe->opcode = URING_OP_READ_MULTISHOT;
+    sqe->fd = term_fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->off = -1;
+    sqe->user_data = URING_RX << 8;
+    uring_rx_armed = 1;
+}
+
+static int uring_rx_done(int res, unsigned flags)
+{
+    int bid, r;
+
+    if (res == -ENOBUFS)
+	return 0;
+    if (res < 0)
+    {
+	fprintf(stderr, "read term_fd: %s (%d)\n", strerror(-res), -res);
+	return -1;
+    }
+    if (res == 0)
+    {
+	fprintf(stderr, "read term_fd: EOF\n");
+	return -1;
+    }
+
+    bid = flags >> IORING_CQE_BUFFER_SHIFT;
+    uring_stats.reads++;
+    r = rx_data(uring_rx_bufs + bid * URING_RX_SIZE, res);
+    uring_rx_give(bid);
+    return r;
+}
+
+/* Queue what is left of a log buffer */
+static void uring_log_submit(int i)
+{
+    struct io_uring_sqe *sqe = uring_sqe();
+    int done = uring_log_done_len[i];
+
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->fd = log_fd;
+    sqe->addr = (unsigned long)(uring_log_bufs + i * URING_LOG_SIZE + done);
+    sqe->len = uring_log_len[i] - done;
+    sqe->off = uring_log_off[i] == -1 ? -1 : uring_log_off[i] + done;
+    sqe->buf_index = i;
+    sqe->user_data = URING_LOG << 8 | i;
+}
+
+static void uring_log_done(int i, int res)
+{
+    if (res > 0 && uring_log_done_len[i] + res < uring_log_len[i])
+    {
+	/* a short write, the rest goes out again at its own offset */
+	uring_log_done_len[i] += res;
+	uring_log_submit(i);
+	return;
+    }
+    if (res <= 0)
+	fprintf(stderr, "write log: %s\n",
+		res < 0 ? strerror(-res) : "nothing written");
+    uring_log_len[i] = 0;
+    uring_log_done_len[i] = 0;
+    uring_log_busy[i] = 0;
+    uring_log_inflight--;
+}
+
+/* Take what has completed.  Log writes are finished off here, reads
+   are queued in order, as a log write waiting for a buffer can get
+   here from inside rx_data(). */
+static void uring_reap(void)
+{
+    struct io_uring_cqe *cqe;
+    unsigned head;
+    unsigned i;
+
+    while ((head = *uring.cq_head) != __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE))
+    {
+	cqe = &uring.cqes[head & *uring.cq_mask];
+	if (cqe->user_data >> 8 == URING_LOG)
+	    uring_log_done(cqe->user_data & 0xff, cqe->res);
+	else
+	{
+	    if (!(cqe->flags & IORING_CQE_F_MORE))
+		uring_rx_armed = 0;
+	    i = uring_rx_tail_q++ % (2 * URING_RX_BUFS);
+	    uring_rx_queue[i].res = cqe->res;
+	    uring_rx_queue[i].flags = cqe->flags;
+	}
+	__atomic_store_n(uring.cq_head, head + 1, __ATOMIC_RELEASE);
+    }
+}
+
+/* Hand the data read to rx_data() */
+static int uring_rx_poll(void)
+{
+    unsigned i;
+
+    uring_reap();
+    while (uring_rx_head != uring_rx_tail_q)
+    {
+	i = uring_rx_head++ % (2 * URING_RX_BUFS);
+	if (uring_rx_done(uring_rx_queue[i].res, uring_rx_queue[i].flags) == -1)
+	    return -1;
+    }
+    return 0;
+}
+
+/* Queue the current log buffer for writing and move to the next.
+   Every write carries its own file offset, so writes that complete
+   out of order, or come back short and are queued again, still land
+   in place.  O_APPEND would make the kernel ignore the offsets, so it
+   is taken off the log until uring_log_drain(). */
+static void uring_log_queue(void)
+{
+    int i = uring_log_cur;
+
+    if (!uring_log_len[i])
+	return;
+
+    if (uring_log_flags == -1)
+    {
+	uring_log_flags = fcntl(log_fd, F_GETFL);
+	uring_log_at = lseek(log_fd, 0, uring_log_flags != -1
+			     && (uring_log_flags & O_APPEND) ? SEEK_END : SEEK_CUR);
+	if (uring_log_flags != -1 && (uring_log_flags & O_APPEND))
+	    fcntl(log_fd, F_SETFL, uring_log_flags & ~O_APPEND);
+    }
+
+    /* not seekable, the writes go out at the current position */
+    uring_log_off[i] = uring_log_at;
+    if (uring_log_at != -1)
+	uring_log_at += uring_log_len[i];
+    uring_log_done_len[i] = 0;
+    uring_log_submit(i);
+
+    uring_stats.writes++;
+    uring_log_busy[i] = 1;
+    uring_log_inflight++;
+    uring_log_cur = (i + 1) % URING_LOG_BUFS;
+}
+
+static ssize_t uring_log_write(const struct iovec *iov, int cnt)
+{
+    const char *p;
+    size_t n, k, total = 0;
+    int i;
+
+    for (i = 0; i < cnt; i++)
+    {
+	p = iov[i].iov_base;
+	n = iov[i].iov_len;
+	total += n;
+
+	while (n)
+	{
+	    if (uring_log_len[uring_log_cur] == URING_LOG_SIZE)
+		uring_log_queue();
+	    while (uring_log_busy[uring_log_cur])
+	    {
+		if (uring_enter(1) == -1)
+		    return -1;
+		uring_reap();
+	    }
+
+	    k = URING_LOG_SIZE - uring_log_len[uring_log_cur];
+	    if (k > n)
+		k = n;
+	    memcpy(uring_log_bufs + uring_log_cur * URING_LOG_SIZE
+		   + uring_log_len[uring_log_cur], p, k);
+	    uring_log_len[uring_log_cur] += k;
+	    p += k;
+	    n -= k;
+	}
+    }
+
+    return total;
+}
+
+/* Submit the log data gathered and rearm the read, once per pass */
+static void uring_flush(void)
+{
+    uring_log_queue();
+    if (uring_rx && !uring_rx_armed && term_fd != -1
+	&& uring_rx_head == uring_rx_tail_q)
+	uring_rx_arm();
+    if (uring.to_submit)
+	uring_enter(0);
+}
+
+/* Wait until everything written to the log has been written, and
+   leave the file as plain writes expect it */
+static void uring_log_drain(void)
+{
+    if (!uring_log)
+	return;
+
+    uring_log_queue();
+    while (uring_log_inflight)
+    {
+	if (uring_enter(1) == -1)
+	{
+	    perror("io_uring_enter");
+	    break;
+	}
+	uring_reap();
+    }
+
+    if (uring_log_flags == -1)
+	return;
+    if (uring_log_at != -1)
+	lseek(log_fd, uring_log_at, SEEK_SET);
+    if (uring_log_flags & O_APPEND)
+	fcntl(log_fd, F_SETFL, uring_log_flags);
+    uring_log_flags = -1;
+}
+
+static void uring_stop(void)
+{
+    if (uring.fd == -1)
+	return;
+
+    uring_log_drain();
+    uring_log = 0;
+    uring_rx_head = uring_rx_tail_q = 0;
+    uring_rx = uring_rx_armed = 0;
+
+    /* closing the ring cancels the read */
+    close(uring.fd);
+    uring.fd = -1;
+    if (uring.sqes)
+	munmap(uring.sqes, uring.sqes_size);
+    if (uring.cq_ring && uring.cq_ring != uring.sq_ring)
+	munmap(uring.cq_ring, uring.cq_ring_size);
+    if (uring.sq_ring)
+	munmap(uring.sq_ring, uring.sq_ring_size);
+    if (uring_rx_ring)
+	munmap(uring_rx_ring, URING_RX_BUFS * sizeof(struct io_uring_buf));
+    if (uring_log_bufs)
+	munmap(uring_log_bufs, URING_LOG_BUFS * URING_LOG_SIZE);
+    free(uring_rx_bufs);
+    uring.sqes = NULL;
+    uring.sq_ring = uring.cq_ring = NULL;
+    uring_rx_ring = NULL;
+    uring_rx_bufs = uring_log_bufs = NULL;
+}
+
+static int uring_start(void)
+{
+    struct io_uring_params p;
+    struct io_uring_probe *probe;
+    struct io_uring_buf_reg reg;
+    struct iovec iov[URING_LOG_BUFS];
+    int i;
+
+    memset(&p, 0, sizeof(p));
+    if ((uring.fd = sys_io_uring_setup(URING_ENTRIES, &p)) == -1)
+	return -1;
+
+    uring.sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    uring.cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if ((p.features & IORING_FEAT_SINGLE_MMAP)
+	&& uring.cq_ring_size > uring.sq_ring_size)
+	uring.sq_ring_size = uring.cq_ring_size;
+    uring.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    uring.sq_ring = mmap(NULL, uring.sq_ring_size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQ_RING);
+    if (uring.sq_ring == MAP_FAILED)
+	goto fail;
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+	uring.cq_ring = uring.sq_ring;
+    else if ((uring.cq_ring = mmap(NULL, uring.cq_ring_size,
+				   PROT_READ | PROT_WRITE,
+				   MAP_SHARED | MAP_POPULATE, uring.fd,
+				   IORING_OFF_CQ_RING)) == MAP_FAILED)
+	goto fail;
+    if ((uring.sqes = mmap(NULL, uring.sqes_size, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, uring.fd,
+			   IORING_OFF_SQES)) == MAP_FAILED)
+	goto fail;
+
+    uring.sq_head = (unsigned *)((char *)uring.sq_ring + p.sq_off.head);
+    uring.sq_tail = (unsigned *)((char *)uring.sq_ring + p.sq_off.tail);
+    uring.sq_mask = (unsigned *)((char *)uring.sq_ring + p.sq_off.ring_mask);
+    uring.sq_array = (unsigned *)((char *)uring.sq_ring + p.sq_off.array);
+    uring.cq_head = (unsigned *)((char *)uring.cq_ring + p.cq_off.head);
+    uring.cq_tail = (unsigned *)((char *)uring.cq_ring + p.cq_off.tail);
+    uring.cq_mask = (unsigned *)((char *)uring.cq_ring + p.cq_off.ring_mask);
+    uring.cqes = (struct io_uring_cqe *)((char *)uring.cq_ring + p.cq_off.cqes);
+    uring.sq_entries = p.sq_entries;
+    uring.to_submit = 0;
+
+    /* registered buffers for the log */
+    uring_log_bufs = mmap(NULL, URING_LOG_BUFS * URING_LOG_SIZE,
+			  PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+			  -1, 0);
+    if (uring_log_bufs == MAP_FAILED)
+    {
+	uring_log_bufs = NULL;
+	goto fail;
+    }
+    for (i = 0; i < URING_LOG_BUFS; i++)
+    {
+	iov[i].iov_base = uring_log_bufs + i * URING_LOG_SIZE;
+	iov[i].iov_len = URING_LOG_SIZE;
+	uring_log_len[i] = uring_log_busy[i] = uring_log_done_len[i] = 0;
+    }
+    uring_log_cur = uring_log_inflight = 0;
+    uring_log_flags = -1;
+    if (sys_io_uring_register(uring.fd, IORING_REGISTER_BUFFERS, iov,
+			      URING_LOG_BUFS) == -1)
+	goto fail;
+
+    /* multishot reads of the port with a ring of provided buffers */
+    probe = calloc(1, sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op));
+    if (probe
+	&& sys_io_uring_register(uring.fd, IORING_REGISTER_PROBE, probe, 256) == 0
+	&& probe->last_op >= URING_OP_READ_MULTISHOT
+	&& (probe->ops[URING_OP_READ_MULTISHOT].flags & IO_URING_OP_SUPPORTED))
+	uring_rx = 1;
+    free(probe);
+
+    if (uring_rx)
+    {
+	uring_rx_ring = mmap(NULL, URING_RX_BUFS * sizeof(struct io_uring_buf),
+			     PROT_READ | PROT_WRITE,
+			     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	uring_rx_bufs = malloc(URING_RX_BUFS * URING_RX_SIZE);
+	if (uring_rx_ring == MAP_FAILED || !uring_rx_bufs)
+	{
+	    uring_rx_ring = NULL;
+	    goto fail;
+	}
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long)uring_rx_ring;
+	reg.ring_entries = URING_RX_BUFS;
+	reg.bgid = 0;
+	if (sys_io_uring_register(uring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+	    uring_rx = 0;
+
+	uring_rx_tail = 0;
+	for (i = 0; uring_rx && i < URING_RX_BUFS; i++)
+	    uring_rx_give(i);
+    }
+
+    uring_log = 1;
+    return 0;
+
+fail:
+    i = errno;
+    if (uring.sq_ring == MAP_FAILED)
+	uring.sq_ring = NULL;
+    if (uring.cq_ring == MAP_FAILED)
+	uring.cq_ring = NULL;
+    if (uring.sqes == MAP_FAILED)
+	uring.sqes = NULL;
+    uring_stop();
+    errno = i;
+    return -1;
+}
+
+/************************************************************************/
+
+/* Searching the scrollback from the escape menu.  Plain patterns are
+   found with memmem() and memrchr(); a pattern starting with "~" is an
+   extended regular expression, which never matches across lines. */
+
+#define SB_CONTEXT	5		/* lines shown around a match */
+#define SB_MAX_LINE	2048		/* shown of lines longer than this */
+
+static char sb_pattern[256];
+static int sb_regex;
+static regex_t sb_re;
+static const char *sb_data;
+static size_t sb_len;
+static unsigned long long sb_pos;	/* stream offset of the last match */
+static size_t sb_match_len;
+
+/* Match the regular expression in [from, to) of the scrollback */
+static long sb_regexec(size_t from, size_t to, size_t *len)
+{
+    regmatch_t m;
+    int eflags = REG_STARTEND;
+
+    if (from > 0 && sb_data[from - 1] != '\n')
+	eflags |= REG_NOTBOL;
+    if (to < sb_len && sb_data[to] != '\n')
+	eflags |= REG_NOTEOL;
+
+    m.rm_so = from;
+    m.rm_eo = to;
+    if (regexec(&sb_re, sb_data, 1, &m, eflags) != 0)
+	return -1;
+
+    *len = m.rm_eo - m.rm_so;
+    return m.rm_so;
+}
+
+/* Find the first, or the last if backward, match of the pattern lying
+   within [from, to) of the scrollback, and return its offset or -1 */
+static long sb_find(size_t from, size_t to, int backward, size_t *len)
+{
+    const char *q;
+    size_t n, lo, end, chunk, o;
+    long r, found;
+
+    if (!sb_regex)
+    {
+	*len = n = strlen(sb_pattern);
+	if (to - from < n)
+	    return -1;
+	if (!backward)
+	{
+	    q = memmem(sb_data + from, to - from, sb_pattern, n);
+	    return q ? q - sb_data : -1;
+	}
+	for (end = to - n + 1; end > from; end = q - sb_data)
+	{
+	    if ((q = memrchr(sb_data + from, sb_pattern[0], end - from)) == NULL)
+		break;
+	    if (memcmp(q, sb_pattern, n) == 0)
+		return q - sb_data;
+	}
+	return -1;
+    }
+
+    if (!backward)
+	return sb_regexec(from, to, len);
+
+    /* go back by growing blocks that start at a line */
+    for (chunk = 65536; to > from; to = lo, chunk *= 2)
+    {
+	lo = to - from > chunk ? to - chunk : from;
+	if ((q = memrchr(sb_data + from, '\n', lo - from)) != NULL)
+	    lo = q - sb_data + 1;
+	else
+	    lo = from;
+
+	found = -1;
+	for (o = lo; o <= to && (r = sb_regexec(o, to, &n)) != -1;
+	     o = r + (n ? n : 1))
+	{
+	    found = r;
+	    *len = n;
+	}
+	if (found != -1)
+	    return found;
+    }
+
+    return -1;
+}
+
+/* Show a match with the lines around it */
+static void sb_show(size_t off, size_t len)
+{
+    const char *q;
+    size_t start, end;
+    int i;
+
+    start = off;
+    for (i = 0; i <= SB_CONTEXT && (q = memrchr(sb_data, '\n', start)); i++)
+	start = q - sb_data;
+    start = i <= SB_CONTEXT ? 0 : start + 1;
+    if (off - start > SB_CONTEXT * SB_MAX_LINE)
+	start = off - SB_CONTEXT * SB_MAX_LINE;
+
+    end = off + len;
+    for (i = 0; i <= SB_CONTEXT
+	     && (q = memchr(sb_data + end, '\n', sb_len - end)); i++)
+	end = q - sb_data + 1;
+    if (i <= SB_CONTEXT)
+	end = sb_len;
+    if (end - off - len > SB_CONTEXT * SB_MAX_LINE)
+	end = off + len + SB_CONTEXT * SB_MAX_LINE;
+
+    printf("\n--- %lu bytes back ---\n", (unsigned long)(sb_len - off));
+    fwrite(sb_data + start, 1, off - start, stdout);
+    printf("\033[7m");
+    fwrite(sb_data + off, 1, len, stdout);
+    printf("\033[m");
+    fwrite(sb_data + off + len, 1, end - off - len, stdout);
+    if (end == start || sb_data[end - 1] != '\n')
+	printf("\n");
+    printf("---\n");
+}
+
+/* Show the match before or after the last one */
+static int sb_next(int backward)
+{
+    unsigned long long base;
+    size_t pos, len;
+    long off;
+
+    sb_data = hist_data(&sb_len);
+    base = hist_head - sb_len;
+    pos = sb_pos > base ? sb_pos - base : 0;
+
+    /* a string match may overlap the last one, but a regex could
+       match a shorter part of it again, so that ends before it */
+    if (backward)
+	off = sb_find(0, sb_regex ? pos : pos + (sb_match_len ? sb_match_len - 1 : 0),
+		      1, &len);
+    else
+	off = pos < sb_len ? sb_find(pos + 1, sb_len, 0, &len) : -1;
+
+    if (off == -1)
+	return 0;
+
+    sb_pos = base + off;
+    sb_match_len = len;
+    sb_show(off, len);
+    return 1;
+}
+
+/* Ask for a pattern and page through its matches, newest first */
+static void sb_browse(void)
+{
+    char line[sizeof(sb_pattern)];
+    int backward = 1;
+    regex_t re;
+    char c = 'n';
+    int r;
+
+    restore_tty();
+    if (!hist_buf)
+    {
+	printf("\nThe scrollback is off\n");
+	setup_tty();
+	return;
+    }
+
+    printf("\nSearch (~ for a regular expression): ");
+    fflush(stdout);
+    if (!fgets(line, sizeof(line), stdin))
+	line[0] = '\0';
+    line[strcspn(line, "\n")] = '\0';
+
+    if (line[0] == '~')
+    {
+	if ((r = regcomp(&re, line + 1, REG_EXTENDED | REG_NEWLINE)) != 0)
+	{
+	    regerror(r, &re, line, sizeof(line));
+	    printf("%s\n", line);
+	    setup_tty();
+	    return;
+	}
+	if (sb_regex)
+	    regfree(&sb_re);
+	sb_re = re;
+	sb_regex = 1;
+    }
+    else if (line[0])
+    {
+	if (sb_regex)
+	    regfree(&sb_re);
+	sb_regex = 0;
+    }
+
+    if (line[0])
+	strcpy(sb_pattern, line + sb_regex);
+    if (!sb_pattern[0])
+    {
+	setup_tty();
+	return;
+    }
+
+    sb_pos = hist_head;
+    sb_match_len = 0;
+    while (c == 'n' || c == 'N')
+    {
+	if (!sb_next(backward))
+	    printf("\nNo %s match\n", backward ? "older" : "newer");
+	printf("n older, N newer, other keys return: ");
+	fflush(stdout);
+
+	setup_tty();
+	if (read(0, &c, 1) != 1)
+	    c = 'q';
+	restore_tty();
+	backward = c == 'n';
+    }
+
+    printf("\n");
+    setup_tty();
+}
+
+/************************************************************************/
+
+static int do_connect(char *args, int extra)
+{
+    fd_set readfds;
+    fd_set writefds;
+    int fd_limit;
+    int r;
+    int escape_seen = 0;
+    char bell = '\a';
+    int term_close = 1;
+    struct timeval tv;
+    long long t;
+
+    /* a command from the control socket can not connect again */
+    if (in_connect)
+    {
+	fprintf(stderr, "Already connected\n");
+	return 0;
+    }
+
+reconnect:
+    if (!term_name)
+    {
+	fprintf(stderr, "No port selected\n");
+	return 0;
+    }
+    in_connect = 1;
+
+    if (!hist_buf && hist_size && hist_alloc(hist_size) == -1)
+	perror("scrollback");
+
+    if (flag_uring && uring.fd == -1 && uring_start() == -1)
+	perror("io_uring, using select");
+
+    if (term_fd == -1)
+	fprintf(stderr, "\nTrying to reconnect to \"%s\"\n", term_name);
+    else
+	fprintf(stderr, "Connected, press \\%03o C to quit\n", escape_char);
+    setup_tty();
+    mon_start();
+
+    while (1)
+    {
+	if (term_fd == -1)
+	    fd_limit = 0 + 1;
+	else
+	    fd_limit = term_fd + 1;
+
+	FD_ZERO(&readfds);
+	FD_ZERO(&writefds);
+	if (tx_space() && !session_mode)
+	    FD_SET(0, &readfds);
+	if (term_fd != -1)
+	{
+	    if (!uring_rx)
+		FD_SET(term_fd, &readfds);
+	    if (tx_head != tx_tail && !tx_wait)
+		FD_SET(term_fd, &writefds);
+	}
+	if (uring.fd != -1)
+	{
+	    uring_flush();
+	    fd_watch(uring.fd, &readfds, &fd_limit);
+	}
+	if (tx_wait)
+	    fd_watch(pace_fd, &readfds, &fd_limit);
+	if (seq_active)
+	    fd_watch(seq_fd, &readfds, &fd_limit);
+	if (mon_running)
+	    fd_watch(mon_pipe[0], &readfds, &fd_limit);
+	ctl_watch(&readfds, &writefds, &fd_limit);
+	pty_watch(&readfds, &fd_limit);
+	tv.tv_sec = 1;
+	tv.tv_usec = 0;
+	if ((t = log_sync_timeout()) != -1 && t < 1000000)
+	    tv.tv_sec = 0, tv.tv_usec = t;
+	if (uring_rx_head != uring_rx_tail_q)
+	    tv.tv_sec = 0, tv.tv_usec = 0;
+
+	if ((r = select(fd_limit, &readfds, &writefds, NULL, &tv)) < 0)
+	{
+	    perror("select");
+	    break;
+	}
+
+	if (log_sync_timeout() == 0)
+	    log_sync();
+
+	if (uring.fd != -1 && uring_rx_poll() == -1)
+	    break;
+
+	if (tx_wait && FD_ISSET(pace_fd, &readfds))
+	{
+	    unsigned long long expirations;
+
+	    if (read(pace_fd, &expirations, sizeof(expirations)) > 0)
+		tx_wait = 0;
+	}
+
+	if (tx_run() == -1)
+	    break;
+
+	if (seq_active && FD_ISSET(seq_fd, &readfds))
+	    seq_timer();
+
+	if (mon_running && FD_ISSET(mon_pipe[0], &readfds) && mon_event() == -1)
+	{
+	    perror("write stdout");
+	    break;
+	}
+
+	ctl_poll(&readfds);
+
+	if (pty_poll(&readfds) == -1)
+	    break;
+
+	if (FD_ISSET(0, &readfds))
+	{
+	    char c;
+	    int n = read(0, &c, 1);
+	    if (n < 0)
+	    {
+		perror("read stdin");
+		break;
+	    }
+	    if (n == 0)
+	    {
+		fprintf(stderr, "read stdin: EOF\n");
+		break;
+	    }
+
+	    /* handle commands */
+	    if (escape_seen)
+	    {
+		escape_seen = 0;
+
+		if (c == escape_char)
+		{
+		    if (pty_busy())
+			write(1, &bell, 1);
+		    else if (term_fd != -1 && tx_data(&c, 1) == -1)
+			break;
+		}
+		else /* if (c == escape_char) */
+		{
+		    switch (tolower(c))
+		    {
+		    case 'h':
+		    case '?':
+			restore_tty();
+			printf("\n"
+			 "\\%03o\tSend \\%03o\n"
+			     "h or ?\tShow this help message\n"
+			     "a\tDetect the port speed\n"
+			     "r\tRun the stored modem line sequence\n"
+			     "/\tSearch the scrollback\n"
+			     "!\tStart a shell\n"
+			     "c\tReturn to the command line\n"
+			     "q\tQuit\n"
+			     "Command> ", escape_char, escape_char);
+			fflush(stdout);
+			setup_tty();
+			escape_seen = 1;
+			break;
+
+		    case 'a':
+			restore_tty();
+			printf("\n");
+			do_autobaud("", 0);
+			setup_tty();
+			break;
+
+		    case 'r':
+			if (!seq_stored || term_fd == -1)
+			    write(1, &bell, 1);
+			else if (!seq_active)
+			    seq_start(seq_stored);
+			break;
+
+		    case '/':
+			sb_browse();
+			break;
+
+		    case '!':
+			restore_tty();
+			puts("\nStarting a shell");
+			system(getenv("SHELL"));
+			puts("\nBack at the terminal");
+			setup_tty();
+			break;
+
+		    case 'c':
+			term_close = 0;
+			goto do_close;
+
+		    case 'b':
+		    {
+			printf("break\n");
+			if (tcsendbreak(term_fd, break_duration) == -1)
+			    perror("break");
+			printf("break done\n");
+			break;
+		    }
+
+		    case 'q':
+		    {
+			restore_tty();
+
+			do_quit("", 0);
+			exit(0);
+		    }
+
+		    default:
+			write(1, &bell, 1);
+			break;
+		    }
+		}
+	    }
+	    else if (c == escape_char)
+		escape_seen = 1;
+	    else if (pty_busy())
+		write(1, &bell, 1);
+	    else if (term_fd != -1)
+	    {
+		if (tx_data(&c, 1) == -1)
+		    break;
+	    }
+	}
+
+	if (term_fd == -1)
+	{
+	    if ((term_fd = open(term_name, O_RDWR | O_NONBLOCK)) != -1)
+	    {
+		setup_term(term_fd);
+		restore_tty();
+		fprintf(stderr, "Connected, press \\%03o C to quit\n", escape_char);
+		setup_tty();
+		mon_start();
+	    }
+	}
+	else if (!uring_rx && FD_ISSET(term_fd, &readfds))
+	{
+	    char buf[1024];
+	    int n = read(term_fd, buf, sizeof(buf));
+	    if (n < 0)
+	    {
+		perror("read term_fd");
+		break;
+	    }
+	    if (n == 0)
+	    {
+		fprintf(stderr, "read term_fd: EOF\n");
+		break;
+	    }
+	    if (rx_data(buf, n) == -1)
+		break;
+	}
+    }
+
+do_close:
+    restore_tty();
+    tx_flush();
+    if (term_fd != -1)
+	rs485_finish();
+    mon_halt();
+    if (seq_active && term_fd != -1)
+	seq_wait();
+    seq_active = 0;
+    uring_stop();
+
+    if (term_close)
+    {
+	if (term_fd != -1)
+	{
+	    close(term_fd);
+	    term_fd = -1;
+
+	    goto reconnect;
+	}
+    }
+
+    in_connect = 0;
+    fprintf(stderr, "\nBack at command prompt\n");
+
+    return 1;
+}
+
+/************************************************************************/
+
+static int do_log_sync(char *args)
+{
+    char *p;
+    long n;
+
+    if (!*args || *args == '?')
+    {
+	fprintf(stderr,
+		"Usage: log sync none|interval <ms>|bytes <n>\n"
+		"Sync the log when the oldest unsynced data is <ms> old,\n"
+		"or when <n> bytes or one second of data is unsynced\n");
+	return 0;
+    }
+
+    if (fuzzy("none", args, &p) && !*p)
+    {
+	log_sync();
+	log_sync_mode = LOG_SYNC_NONE;
+	return 1;
+    }
+
+    if (!fuzzy("interval", args, &p) && !fuzzy("bytes", args, &p))
+	goto invalid;
+
+    n = strtol(p, &p, 10);
+    while (*p && isspace(*p))
+	++p;
+    if (*p || n < 1)
+	goto invalid;
+
+    log_sync();
+    if (fuzzy("interval", args, &p))
+    {
+	log_sync_mode = LOG_SYNC_INTERVAL;
+	log_sync_ms = n;
+    }
+    else
+    {
+	log_sync_mode = LOG_SYNC_BYTES;
+	log_sync_bytes = n;
+    }
+
+    return 1;
+
+invalid:
+    fprintf(stderr, "Invalid parameter, try \"log sync ?\" for help\n");
+    return 0;
+}
+
+static void log_started(const char *fn)
+{
+    log_name = strdup(fn);
+    log_bol = 1;
+    log_pos = log_alloc = log_ring ? 0 : lseek(log_fd, 0, SEEK_END);
+    log_unsynced = 0;
+    memset(&log_stats, 0, sizeof(log_stats));
+}
+
+/* Log to a ring file of a fixed size */
+static int do_log_ring(char *args)
+{
+    char *fn, *p;
+    unsigned long size;
+    int fd;
+
+    fn = p = args;
+    while (*p && !isspace(*p))
+	++p;
+    if (*p)
+	*p++ = '\0';
+    size = parse_size(p, &p);
+    while (*p && isspace(*p))
+	++p;
+    if (!*fn || *p || size < 1024)
+    {
+	fprintf(stderr, "Invalid parameter, try \"log ?\" for help\n");
+	return 0;
+    }
+
+    if ((fd = open(fn, O_CREAT | O_RDWR, 0777)) != -1 && ring_foreign(fd))
+    {
+	fprintf(stderr, "\"%s\" is not a ring log, remove it first to reuse it\n",
+		fn);
+	close(fd);
+	return 0;
+    }
+
+    if (fd == -1 || (log_ring = ring_open(fd, size)) == NULL)
+    {
+	fprintf(stderr,
+		"failed to open \"%s\" as a ring log: %s\n",
+		fn, strerror(errno));
+	if (fd != -1)
+	    close(fd);
+	return 0;
+    }
+
+    log_fd = fd;
+    log_started(fn);
+    fprintf(stderr, "Logging started to \"%s\", keeping the last %lu bytes\n",
+	    fn, size);
+
+    return 1;
+}
+
+static int do_log_clean(char *args)
+{
+    char *p;
+
+    if (!*args || *args == '?')
+    {
+	fprintf(stderr,
+		"Usage: log clean <filename>|stop\n"
+		"Also log what is received to <filename> without terminal\n"
+		"control sequences\n");
+	return 0;
+    }
+
+    if (fuzzy("stop", args, &p) && !*p)
+    {
+	if (clean_fd != -1)
+	    fprintf(stderr, "Clean log stopped\n");
+	clean_close();
+	return 1;
+    }
+
+    clean_close();
+    if ((clean_fd = open(args, O_CREAT | O_TRUNC | O_WRONLY, 0777)) == -1)
+    {
+	fprintf(stderr, "failed to open \"%s\" for logging: %s\n",
+		args, strerror(errno));
+	return 0;
+    }
+
+    clean_name = strdup(args);
+    clean_state = CLEAN_TEXT;
+    clean_cr = 0;
+    clean_in = clean_out = clean_removed = 0;
+    fprintf(stderr, "Clean log started to \"%s\"\n", args);
+
+    return 1;
+}
+
+static int do_log(char *args, int extra)
+{
+    char *fn;
+    int flags;
+
+    if (!*args || *args == '?')
+    {
+	fprintf(stderr,
+		"Usage: log overwrite|append|stop <filename>\n"
+		"       log ring <filename> <size>[k|m|g]\n"
+		"       log clean <filename>|stop\n"
+		"       log sync none|interval <ms>|bytes <n>\n");
+	return 0;
+    }
+
+    /* "log s" has always meant stop */
+    if (strncasecmp(args, "sy", 2) == 0 && fuzzy("sync", args, &fn))
+	return do_log_sync(fn);
+    if (fuzzy("clean", args, &fn))
+	return do_log_clean(fn);
+
+    if (log_fd == -1 && fuzzy("stop", args, &fn))
+    {
+	printf("No log active\n");
+	return 1;
+    }
+
+    if (log_fd != -1)
+    {
+	fprintf(stderr, "Logging stopped\n");
+	log_close();
+    }
+
+    if (fuzzy("stop", args, &fn))
+	return 1;
+
+    if (fuzzy("ring", args, &fn))
+	return do_log_ring(fn);
+
+    if (!fn)
+	fn = "tt.log";
+
+    if (fuzzy("overwrite", args, &fn))
+	flags = O_CREAT | O_TRUNC | O_WRONLY;
+    else if (fuzzy("append", args, &fn))
+	flags = O_CREAT | O_APPEND | O_WRONLY;
+    else
+    {
+	fprintf(stderr, "Invalid parameter, try \"log ?\" for help\n");
+	return 0;
+    }
+
+    log_fd = open(fn, flags, 0777);
+    if (log_fd == -1)
+    {
+	fprintf(stderr,
+		"failed to open \"%s\" for logging: %s\n",
+		fn, strerror(errno));
+	return 0;
+    }
+
+    log_started(fn);
+    fprintf(stderr, "Logging started to \"%s\"\n", fn);
+
+    return 1;
+}
+
+/************************************************************************/
+
+static int do_quit(char *args, int extra)
+{
+    if (term_fd != -1)
+	close(term_fd);
+
+    if (log_fd != -1)
+    {
+	printf("Logging stopped\n");
+	log_close();
+    }
+
+    cap_done();
+    cmp_stop();
+    ctl_close();
+    pty_close();
+    clean_close();
+
+    printf("Bye!\n");
+    exit(1);
+}
+
+/************************************************************************/
+
+static int do_set_break(char *args, int extra)
+{
+    long t;
+    char *p;
+
+    if (!*args || *args == '?')
+    {
+	fprintf(stderr,
+		"Usage: set break <duration>\n"
+		"Where duration is in 1/10 seconds from 1 to 50\n");
+	return 0;
+    }
+
+    t = strtol(args, &p, 10);
+    while (*p && isspace(*p))
+	++p;
+
+    if (*p || t < 1)
+    {
+	fprintf(stderr,
+		"Invalid parameter, try \"set break ?\" for help\n");
+	return 0;
+    }
+
+    break_duration = t;
+
+    return 1;
+}
+
+/************************************************************************/
+
+static int do_set_escape(char *args, int extra)
+{
+    long c;
+    char *p;
+
+    if (!*args || *args == '?')
+    {
+	fprintf(stderr,
+		"Usage: set escape <character>\n"
+	       "Where character is an ASCII value from 0 to 255\n");
+	return 0;
+    }
+
+    c = strtoul(args, &p, 10);
+    while (*p && isspace(*p))
+	++p;
+
+    if (*p || c < 0 || c > 255)
+    {
+	fprintf(stderr, "Invalid parameter, try \"set escape ?\" for help\n");
+	return 0;
+    }
+
+    escape_char = c;
+
+    return 1;
+}
+
+/************************************************************************/
+
+static int do_set_flow(char *args, int extra)
+{
+    struct termios termios;
+    char *space;
+    int flags;
+
+    if (!*args || *args == '?')
+    {
+	fprintf(stderr, "Usage: set flow rtscts|none\n");
+	return 0;
+    }
+
+    space = args;
+    while (*space && !isspace(*space))
+	++space;
+
+    if (strncasecmp(args, "none", space-args) == 0)
+	flags = 0;
+    else if (strncasecmp(args, "rtscts", space-args) == 0)
+	flags = CRTSCTS;
+    else
+    {
+	fprintf(stderr, "Invalid parameter, try \"set flow ?\" for help\n");
+	return 0;
+    }
+
+    if (term_fd == -1)
+    {
+	printf("No port selected\n");
+	return 0;
+    }
+
+    if (tcgetattr(term_fd, &termios) == -1)
+    {
+	perror("tcgetattr");
+	return 0;
+    }
+
+    termios.c_cflag &= ~CRTSCTS;
+    termios.c_cflag |= flags;
+
+    if (tcsetattr(term_fd, TCSANOW, &termios) == -1)
+    {
+	perror("tcsetattr");
+	return 0;
+    }
+
+    return 1;
+}
+
+/************************************************************************/
+
+static int do_set_nlcr(char *args, int extra)
+{
+    char *space;
+
+    if (!*args || *args == '?')
+    {
+	fprintf(stderr, "Usage: set nlcr on|off\n");
+	return 0;
+    }
+
+    space = args;
+    while (*space && !isspace(*space))
+	++space;
+
+    if (space-args > 1 && strncasecmp(args, "on", space-args) == 0)
+	flag_nlcr = 1;
+    else if (space-args > 1 && strncasecmp(args, "off", space-args) == 0)
+	flag_nlcr = 0;
+    else
+    {
+	fprintf(stderr, "Invalid parameter, try \"set nlcr ?\" for help\n");
+	return 0;
+    }
+
+    return 1;
+}
+
+/************************************************************************/
+
+
+static int do_set_modem(char *args, int extra)
+{
+    struct termios termios;
+    char *space;
+    int flags;
+
+    if (!*args || *args == '?')
+    {
+	fprintf(stderr, "Usage: set modem on|off\n");
+	return 0;
+    }
+
+    space = args;
+    while (*space && !isspace(*space))
+	++space;
+
+    if (space-args > 1 && strncasecmp(args, "on", space-args) == 0)
+	flags = HUPCL;
+    else if (space-args > 1 && strncasecmp(args, "off", space-args) == 0)
+	flags = CLOCAL;
+    else
+    {
+	fprintf(stderr, "Invalid parameter, try \"set modem ?\" for help\n");
+	return 0;
+    }
+
+    if (term_fd == -1)
+    {
+	printf("No port selected\n");
+	return 0;
+    }
+
+    if (tcgetattr(term_fd, &termios) == -1)
+    {
+	perror("tcgetattr");
+	return 0;
+    }
+
+    termios.c_cflag &= ~(CLOCAL|HUPCL);
+    termios.c_cflag |= flags;
+
+    if (tcsetattr(term_fd, TCSANOW, &termios) == -1)
+    {
+	perror("tcsetattr");
+	return 0;
+    }
+
+    return 1;
+}
+
+/************************************************************************/
+
+static int do_set_framing(char *args, int extra)
+{
+    const struct framing *f;
+    char *space;
+
+    if (!*args || *args == '?')
+    {
+	fprintf(stderr, "Usage: set framing none|slip|cobs|hdlc\n");
+	return 0;
+    }
+
+    space = args;
+    while (*space && !isspace(*space))
+	++space;
+
+    for (f = framings; f->name; f++)
+	if (strncasecmp(args, f->name, space-args) == 0)
+	    break;
+
+    if (!f->name || *space)
+    {
+	fprintf(stderr, "Invalid parameter, try \"set framing ?\" for help\n");
+	return 0;
+    }
+
+    set_framing(f);
+
+    return 1;
+}
+
+/************************************************************************/
+
+static int do_set_hex(char *args, int extra)
+{
+    struct termios termios;
+    char *space;
+    int flags;
+
+    if (!*args || *args == '?')
+    {
+	fprintf(stderr, "Usage: set hex on|off\n");
+	return 0;
+    }
+
+    space = args;
+    while (*space && !isspace(*space))
+	++space;
+
+    if (space-args > 1 && strncasecmp(args, "on", space-args) == 0)
+	flags = HUPCL;
+    else if (space-args > 1 && strncasecmp(args, "off", space-args) == 0)
+	flags = CLOCAL;
+    else
+    {
+	fprintf(stderr, "Invalid parameter, try \"set hex ?\" for help\n");
+	return 0;
+    }
+
+    if (term_fd == -1)
+    {
+	printf("No port selected\n");
+	return 0;
+    }
+
+    if (tcgetattr(term_fd, &termios) == -1)
+    {
+	perror("tcgetattr");
+	return 0;
+    }
+
+    termios.c_cflag &= ~(CLOCAL|HUPCL);
+    termios.c_cflag |= flags;
+
+    if (tcsetattr(term_fd, TCSANOW, &termios) == -1)
+    {
+	perror("tcsetattr");
+	return 0;
+    }
+
+    return 1;
+}
+
+/************************************************************************/
+
+static int do_set_translate(char *args, int extra)
+{
+    struct xlat *x;
+    char *p;
+
+    if (!*args || *args == '?')
+    {
+	fprintf(stderr,
+		"Usage: set translate rx|tx <rule>...|off\n"
+		"Translate the data shown (rx) or sent (tx), the rules are\n"
+		"applied in order:\n"
+		"    strip     clear the 8th bit\n"
+		"    <c>=<s>   replace the character <c> with the string <s>,\n"
+		"              which may be empty, with \\r, \\n, \\t and \\xNN\n"
+		"For example \"set translate tx \\n=\\r\\n\" or\n"
+		"\"set translate rx \\r= strip\"\n");
+	return 0;
+    }
+
+    if (fuzzy("rx", args, &p))
+	x = &xlat_rx;
+    else if (fuzzy("tx", args, &p))
+	x = &xlat_tx;
+    else
+	goto invalid;
+
+    if (fuzzy("off", p, &p) && !*p)
+    {
+	x->active = 0;
+	return 1;
+    }
+
+    if (*p && xlat_set(x, p) == 0)
+	return 1;
+
+invalid:
+    fprintf(stderr, "Invalid parameter, try \"set translate ?\" for help\n");
+    return 0;
+}
+
+static int do_set_pty(char *args, int extra)
+{
+    char *link, *p;
+    int exclusive = 0;
+    long hold = PTY_HOLD_MS;
+
+    if (!*args || *args == '?')
+    {
+	fprintf(stderr,
+		"Usage: set pty on|<link>|off [exclusive [<hold ms>]]\n"
+		"Mirror the port on a pseudo-terminal, optionally with a\n"
+		"symbolic link to it.  In exclusive mode typing is not sent\n"
+		"to the port while the pty is in use, until it has been\n"
+		"quiet for the hold time (default %d ms)\n", PTY_HOLD_MS);
+	return 0;
+    }
+
+    link = strtok(args, " \t");
+    if ((p = strtok(NULL, " \t")) != NULL)
+    {
+	if (!fuzzy("exclusive", p, &p) || *p)
+	    goto invalid;
+	exclusive = 1;
+	if ((p = strtok(NULL, " \t")) != NULL)
+	{
+	    hold = strtol(p, &p, 10);
+	    if (*p || hold < 0 || strtok(NULL, " \t"))
+		goto invalid;
+	}
+    }
+
+    if (fuzzy("off", link, &p) && !*p)
+    {
+	pty_close();
+	return 1;
+    }
+
+    if (!(fuzzy("on", link, &p) && !*p) && pty_open(link) == -1)
+	return 0;
+    if (pty_fd == -1 && pty_open(NULL) == -1)
+	return 0;
+
+    pty_exclusive = exclusive;
+    pty_hold_ms = hold;
+    printf("pty %s\n", pty_name);
+
+    return 1;
+
+invalid:
+    fprintf(stderr, "Invalid parameter, try \"set pty ?\" for help\n");
+    return 0;
+}
+
+static int do_set_uring(char *args, int extra)
+{
+    char *space;
+
+    if (!*args || *args == '?')
+    {
+	fprintf(stderr,
+		"Usage: set uring on|off\n"
+		"Use io_uring for reading the port and writing the log,\n"
+		"from the next connect\n");
+	return 0;
+    }
+
+    space = args;
+    while (*space && !isspace(*space))
+	++space;
+
+    if (space-args > 1 && strncasecmp(args, "on", space-args) == 0)
+	flag_uring = 1;
+    else if (space-args > 1 && strncasecmp(args, "off", space-args) == 0)
+	flag_uring = 0;
+    else
+    {
+	fprintf(stderr, "Invalid parameter, try \"set uring ?\" for help\n");
+	return 0;
+    }
+
+    return 1;
+}
+
+static int do_set_echo(char *args, int extra)
+{
+    char *space;
+
+    if (!*args || *args == '?')
+    {
+	fprintf(stderr,
+		"Usage: set echo on|off\n"
+		"Show what is sent to the port\n");
+	return 0;
+    }
+
+    space = args;
+    while (*space && !isspace(*space))
+	++space;
+
+    if (space-args > 1 && strncasecmp(args, "on", space-args) == 0)
+	flag_echo = 1;
+    else if (space-args > 1 && strncasecmp(args, "off", space-args) == 0)
+	flag_echo = 0;
+    else
+    {
+	fprintf(stderr, "Invalid parameter, try \"set echo ?\" for help\n");
+	return 0;
+    }
+
+    return 1;
+}
+
+static int do_set_timestamp(char *args, int extra)
+{
+    char *space;
+
+    if (!*args || *args == '?')
+    {
+	fprintf(stderr, "Usage: set timestamp on|off\n");
+	return 0;
+    }
+
+    space = args;
+    while (*space && !isspace(*space))
+	++space;
+
+    if (space-args > 1 && strncasecmp(args, "on", space-args) == 0)
+	flag_timestamp = 1;
+    else if (space-args > 1 && strncasecmp(args, "off", space-args) == 0)
+	flag_timestamp = 0;
+    else
+    {
+	fprintf(stderr, "Invalid parameter, try \"set timestamp ?\" for help\n");
+	return 0;
+    }
+
+    return 1;
+}
+
+/************************************************************************/
+
+static int do_set_monitor(char *args, int extra)
+{
+    char *space;
+
+    if (!*args || *args == '?')
+    {
+	fprintf(stderr,
+		"Usage: set monitor on|off\n"
+		"Show and log changes of CTS, DSR, DCD and RI while connected\n");
+	return 0;
+    }
+
+    space = args;
+    while (*space && !isspace(*space))
+	++space;
+
+    if (space-args > 1 && strncasecmp(args, "on", space-args) == 0)
+	flag_monitor = 1;
+    else if (space-args > 1 && strncasecmp(args, "off", space-args) == 0)
+	flag_monitor = 0;
+    else
+    {
+	fprintf(stderr, "Invalid parameter, try \"set monitor ?\" for help\n");
+	return 0;
+    }
+
+    return 1;
+}
+
+/************************************************************************/
+
+static int do_set_control(char *args, int extra)
+{
+    char *p;
+
+    if (!*args || *args == '?')
+    {
+	fprintf(stderr,
+		"Usage: set control <path>|off\n"
+		"Accept commands and data on a unix domain socket while\n"
+		"connected, the path is also put in $TT_CONTROL\n");
+	return 0;
+    }
+
+    /* closing the socket would free the client being served */
+    if (ctl_handling)
+    {
+	fprintf(stderr, "The control socket can not be changed through itself\n");
+	return 0;
+    }
+
+    if (fuzzy("off", args, &p) && !*p)
+    {
+	ctl_close();
+	return 1;
+    }
+
+    return ctl_open(args) == 0;
+}
+
+/************************************************************************/
+
+static int do_set_scrollback(char *args, int extra)
+{
+    char *p;
+    unsigned long n;
+
+    if (!*args || *args == '?')
+    {
+	fprintf(stderr,
+		"Usage: set scrollback <size>[k|m|g]|off\n"
+		"Keep the last <size> bytes shown while connected, to be\n"
+		"searched with the escape character followed by /\n");
+	return 0;
+    }
+
+    if (fuzzy("off", args, &p) && !*p)
+	n = 0;
+    else
+    {
+	n = parse_size(args, &p);
+	while (*p && isspace(*p))
+	    ++p;
+	if (*p || n == 0 || n > SSIZE_MAX / 2)
+	{
+	    fprintf(stderr, "Invalid parameter, try \"set scrollback ?\" for help\n");
+	    return 0;
+	}
+    }
+
+    if ((hist_buf || n == 0) && hist_alloc(n) == -1)
+    {
+	perror("scrollback");
+	return 0;
+    }
+    hist_size = n;
+
+    return 1;
+}
+
+static int do_set_pacing(char *args, int extra)
+{
+    char *p;
+    long t;
+
+    if (!*args || *args == '?'
+	|| ((fuzzy("char", args, &p) || fuzzy("line", args, &p)) && !*p))
+    {
+	fprintf(stderr,
+		"Usage: set pacing char <us>|line <ms>|off\n"
+		"Delay after each character sent in microseconds, or\n"
+		"after each end of line in milliseconds\n");
+	return 0;
+    }
+
+    if (fuzzy("off", args, &p) && !*p)
+    {
+	pace_char_us = 0;
+	pace_line_ms = 0;
+	return 1;
+    }
+
+    if (!fuzzy("char", args, &p) && !fuzzy("line", args, &p))
+	goto invalid;
+
+    t = strtol(p, &p, 10);
+    while (*p && isspace(*p))
+	++p;
+    if (*p || t < 0)
+	goto invalid;
+
+    if (tx_timer_open() == -1)
+	return 0;
+
+    if (fuzzy("char", args, &p))
+	pace_char_us = t;
+    else
+	pace_line_ms = t;
+
+    return 1;
+
+invalid:
+    fprintf(stderr, "Invalid parameter, try \"set pacing ?\" for help\n");
+    return 0;
+}
+
+/************************************************************************/
+
+static int do_set_port(char *args, int extra)
+{
+    if (!*args || *args == '?')
+    {
+	printf("Usage: set port <device>\n");
+	return 0;
+    }
+
+    free((void *)term_name);
+    term_name = NULL;
+    setenv("TT_PORT", "", 1);
+
+    if (term_fd != -1)
+	close(term_fd);
+
+    if ((term_fd = open(args, O_RDWR | O_NONBLOCK)) == -1)
+    {
+	fprintf(stderr, "failed to open %s: %s\n", args, strerror(errno));
+	return 0;
+    }
+
+    term_name = strdup(args);
+    setenv("TT_PORT", args, 1);
+
+    setup_term(term_fd);
+
+    return 1;
+}
+
+/************************************************************************/
+
+static int do_set_rs485(char *args, int extra)
+{
+    char *p, *end;
+    int mode = RS485_KERNEL;
+    int rts_low = 0, rx_during_tx = 0;
+    long before = 0, after = 0, *delay;
+
+    if (!*args || *args == '?')
+    {
+	fprintf(stderr,
+		"Usage: set rs485 off|on [low] [before <ms>] [after <ms>] [rxtx] [software]\n"
+		"Drive RTS while sending: high unless \"low\", raised <ms>\n"
+		"before the first byte and dropped <ms> after the last.\n"
+		"\"rxtx\" keeps receiving while sending.  The kernel does this\n"
+		"where the driver can, otherwise or with \"software\" tt does\n");
+	return 0;
+    }
+
+    if (fuzzy("off", args, &p) && !*p)
+	mode = RS485_OFF;
+    else if (fuzzy("on", args, &p))
+    {
+	for (p = strtok(p, " \t"); p; p = strtok(NULL, " \t"))
+	{
+	    if (strcasecmp(p, "low") == 0)
+		rts_low = 1;
+	    else if (strcasecmp(p, "rxtx") == 0)
+		rx_during_tx = 1;
+	    else if (strcasecmp(p, "software") == 0)
+		mode = RS485_SOFTWARE;
+	    else if (strcasecmp(p, "before") == 0 || strcasecmp(p, "after") == 0)
+	    {
+		delay = *p == 'b' || *p == 'B' ? &before : &after;
+		if ((p = strtok(NULL, " \t")) == NULL)
+		    goto invalid;
+		*delay = strtol(p, &end, 10);
+		if (*end || *delay < 0 || *delay > 1000)
+		    goto invalid;
+	    }
+	    else
+		goto invalid;
+	}
+    }
+    else
+	goto invalid;
+
+    rs485_wanted = mode;
+    rs485_rts_low = rts_low;
+    rs485_before_ms = before;
+    rs485_after_ms = after;
+    rs485_rx_during_tx = rx_during_tx;
+    if (term_fd != -1)
+	rs485_apply(term_fd);
+
+    return 1;
+
+invalid:
+    fprintf(stderr, "Invalid parameter, try \"set rs485 ?\" for help\n");
+    return 0;
+}
+
+static int do_set_rts(char *args, int extra)
+{
+    int flags;
+    char *space;
+
+    if (!*args || *args == '?')
+    {
+	printf("Usage: set rts on/off\n");
+	return 0;
+    }
+
+    space = args;
+    while (*space && !isspace(*space))
+	++space;
+
+    if (term_fd == -1)
+    {
+	printf("No port selected\n");
+	return 0;
+    }
+
+    if (ioctl(term_fd, TIOCMGET, &flags) == -1) {
+	perror("TIOCMGET");
+	return 0;
+    }
+
+    if (space-args > 1 && strncasecmp(args, "on", space-args) == 0)
+	flags |= TIOCM_RTS;
+    else if (space-args > 1 && strncasecmp(args, "off", space-args) == 0)
+	flags &= ~TIOCM_RTS;
+    else
+    {
+	fprintf(stderr, "Invalid parameter, try \"set rts ?\" for help\n");
+	return 0;
+    }
+
+    if (ioctl(term_fd, TIOCMSET, &flags) == -1) {
+	perror("TIOCMSET");
+	return 0;
+    }
+
+    return 1;
+}
+
+/************************************************************************/
+
+static int do_set_dtr(char *args, int extra)
+{
+    int flags;
+    char *space;
+
+    if (!*args || *args == '?')
+    {
+	printf("Usage: set dtr on/off\n");
+	return 0;
+    }
+
+    space = args;
+    while (*space && !isspace(*space))
+	++space;
+
+    if (term_fd == -1)
+    {
+	printf("No port selected\n");
+	return 0;
+    }
+
+    if (ioctl(term_fd, TIOCMGET, &flags) == -1) {
+	perror("TIOCMGET");
+	return 0;
+    }
+
+    if (space-args > 1 && strncasecmp(args, "on", space-args) == 0)
+	flags |= TIOCM_DTR;
+    else if (space-args > 1 && strncasecmp(args, "off", space-args) == 0)
+	flags &= ~TIOCM_DTR;
+    else
+    {
+	fprintf(stderr, "Invalid parameter, try \"set dtr ?\" for help\n");
+	return 0;
+    }
+
+    if (ioctl(term_fd, TIOCMSET, &flags) == -1) {
+	perror("TIOCMSET");
+	return 0;
+    }
+
+    return 1;
+}
+
+/************************************************************************/
+
+static void seq_usage(const char *cmd)
+{
+    fprintf(stderr,
+	    "Usage: %s <step>...\n"
+	    "Where a step is one of:\n"
+	    "    dtr on|off\n"
+	    "    rts on|off\n"
+	    "    break <ms>\n"
+	    "    wait <ms>\n"
+	    "    pulse dtr|rts|break <ms>\n", cmd);
+}
+
+static int do_sequence(char *args, int extra)
+{
+    if (*args == '?' || (!*args && !seq_stored))
+    {
+	seq_usage("sequence");
+	fprintf(stderr, "Without steps the stored sequence is run\n");
+	return 0;
+    }
+
+    if (seq_start(*args ? args : seq_stored) == -1 || seq_wait() == -1)
+	return 0;
+
+    return 1;
+}
+
+static int do_record(char *args, int extra)
+{
+    char *fn, *p;
+    unsigned long long n = 0;
+    int len = 0;
+
+    if (!*args || *args == '?')
+    {
+	fprintf(stderr,
+		"Usage: record <filename> [until <pattern>|bytes <n>[k|m|g]]\n"
+		"       record stop\n"
+		"Save received data to a file instead of showing it, until\n"
+		"the pattern, which may contain \\r, \\n, \\t and \\xNN, is\n"
+		"received, <n> bytes have been received or \"record stop\"\n");
+	return 0;
+    }
+
+    if (fuzzy("stop", args, &p) && !*p)
+    {
+	if (!cap_name)
+	{
+	    printf("Not recording\n");
+	    return 1;
+	}
+	cap_done();
+	return 1;
+    }
+
+    if (cap_name)
+    {
+	fprintf(stderr, "Already recording to \"%s\"\n", cap_name);
+	return 0;
+    }
+
+    fn = p = args;
+    while (*p && !isspace(*p))
+	++p;
+    if (*p)
+	*p++ = '\0';
+    while (*p && isspace(*p))
+	++p;
+
+    if (*p && fuzzy("until", p, &p))
+    {
+	if (strlen(p) >= CAP_PATTERN_MAX || (len = unescape(p)) == 0)
+	    goto invalid;
+    }
+    else if (*p && fuzzy("bytes", p, &p))
+    {
+	n = parse_size(p, &p);
+	if (*p || n == 0)
+	    goto invalid;
+    }
+    else if (*p)
+	goto invalid;
+
+    if ((cap_fd = open(fn, O_CREAT | O_TRUNC | O_WRONLY, 0777)) == -1)
+    {
+	fprintf(stderr, "failed to open \"%s\" for recording: %s\n",
+		fn, strerror(errno));
+	return 0;
+    }
+
+    if (!crc32_table[0][1])
+    {
+	crc_init(crc32_table, 0xedb88320);
+	crc_init(crc32c_table, 0x82f63b78);
+#ifdef HAVE_CRC32C_HW
+	cap_crc32c_hw = __builtin_cpu_supports("sse4.2");
+#endif
+    }
+
+    cap_name = strdup(fn);
+    memcpy(cap_pattern, p, len);
+    cap_pattern_len = len;
+    cap_hold_len = 0;
+    cap_left = n;
+    cap_bytes = 0;
+    cap_first_us = 0;
+    cap_crc32 = cap_crc32c = 0xffffffff;
+
+    return 1;
+
+invalid:
+    fprintf(stderr, "Invalid parameter, try \"record ?\" for help\n");
+    return 0;
+}
+
+/************************************************************************/
+
+static int do_golden(char *args, int extra)
+{
+    char *p;
+
+    if (!*args || *args == '?')
+    {
+	fprintf(stderr,
+		"Usage: golden <golden log>|stop\n"
+		"       golden mask <regex>|off\n"
+		"Follow the received lines in a golden log and report lines\n"
+		"that are unexpected or missing.  Timestamps and addresses\n"
+		"are masked, masks hide more\n");
+	return 0;
+    }
+
+    if (fuzzy("stop", args, &p) && !*p)
+    {
+	cmp_stop();
+	return 1;
+    }
+
+    if (fuzzy("mask", args, &p))
+    {
+	if (!*p)
+	{
+	    fprintf(stderr, "Invalid parameter, try \"golden ?\" for help\n");
+	    return 0;
+	}
+	/* the golden lines were hashed with the masks of the time */
+	if (cmp_golden)
+	{
+	    fprintf(stderr, "Masks can not be changed during a comparison, "
+		    "use \"golden stop\" first\n");
+	    return 0;
+	}
+	if (fuzzy("off", p, &args) && !*args)
+	{
+	    while (cmp_nmasks)
+		regfree(&cmp_masks[--cmp_nmasks]);
+	    return 1;
+	}
+	return cmp_add_mask(p) == 0;
+    }
+
+    cmp_stop();
+    if ((cmp_golden = cmp_load(args)) == NULL)
+	return 0;
+    cmp_pos = cmp_line_len = 0;
+    cmp_matched = cmp_unexpected = cmp_missing = 0;
+    printf("Comparing with \"%s\", %ld lines\n", args, cmp_golden->n);
+
+    return 1;
+}
+
+static int do_pulse(char *args, int extra)
+{
+    char buf[256];
+
+    if (!*args || *args == '?')
+    {
+	fprintf(stderr, "Usage: pulse dtr|rts|break <ms>\n");
+	return 0;
+    }
+
+    snprintf(buf, sizeof(buf), "pulse %s", args);
+    if (seq_start(buf) == -1 || seq_wait() == -1)
+	return 0;
+
+    return 1;
+}
+
+static int do_set_sequence(char *args, int extra)
+{
+    if (!*args || *args == '?')
+    {
+	seq_usage("set sequence");
+	fprintf(stderr,
+		"The sequence is run by \"sequence\" or by the escape\n"
+		"character followed by \"r\" while connected\n");
+	return 0;
+    }
+
+    if (seq_active)
+    {
+	fprintf(stderr, "A sequence is already running\n");
+	return 0;
+    }
+
+    if (seq_parse(args) == -1)
+    {
+	fprintf(stderr, "Invalid parameter, try \"set sequence ?\" for help\n");
+	return 0;
+    }
+
+    free(seq_stored);
+    seq_stored = strdup(args);
+
+    return 1;
+}
+
+/************************************************************************/
+
+static int do_set_speed(char *args, int extra)
+{
+    struct termios termios;
+    long speed;
+    int speedcode;
+    char *p;
+
+    if (!*args || *args == '?')
+    {
+	struct speed *sp;
+	printf("Usage: set speed <speed>\n"
+	       "Where speed is one of: ");
+	for (sp = speedtab; sp->speed != 0; ++sp)
+	{
+	    if (sp != speedtab)
+		putchar(',');
+	    if ((sp - speedtab) % 10 == 0)
+		printf("\n    ");
+	    else
+		putchar(' ');
+	    printf("%ld", sp->speed);
+	}
+	putchar('\n');
+	return 0;
+    }
+
+    speed = strtol(args, &p, 10);
+    while (*p && isspace(*p))
+	++p;
+
+    if (*p || (speedcode = speed_to_code(speed)) == -1)
+    {
+	fprintf(stderr, "Invalid parameter, try \"set speed ?\" for help\n");
+	return 0;
+    }
+
+    if (term_fd == -1)
+    {
+	printf("No port selected\n");
+	return 0;
+    }
+
+    if (tcgetattr(term_fd, &termios) == -1)
+    {
+	perror("tcgetattr");
+	return 0;
+    }
+
+    cfsetospeed(&termios, speedcode);
+    cfsetispeed(&termios, speedcode);
+
+    if (tcsetattr(term_fd, TCSANOW, &termios) == -1)
+    {
+	perror("tcsetattr");
+	return 0;
+    }
+
+    return 1;
+}
+
+/************************************************************************/
+
+/* Automatic speed detection.  Incoming data is sampled at each
+   candidate speed with framing errors marked by PARMRK, and each speed
+   is scored by the fraction of printable characters minus a penalty
+   for framing errors.  The most common speeds are tried first and the
+   search stops as soon as a speed gives clean text. */
+
+static const long autobaud_speeds[] =
+{
+    115200, 9600, 57600, 38400, 19200, 230400, 460800, 921600,
+    4800, 2400, 1200, -1
+};
+
+struct autobaud_score
+{
+    int bytes;
+    int errors;
+    int printable;
+};
+
+static int autobaud_sample(int fd, struct termios *termios, long speed,
+			   struct autobaud_score *sc)
+{
+    unsigned char buf[4096];
+    long long window, deadline, now;
+    struct pollfd pfd;
+    int len = 0;
+    int n, i;
+
+    /* long enough to see about 32 characters, at least 20 ms */
+    window = 32 * 10 * 1000000LL / speed;
+    if (window < 20000)
+	window = 20000;
+
+    cfsetospeed(termios, speed_to_code(speed));
+    cfsetispeed(termios, speed_to_code(speed));
+    if (tcsetattr(fd, TCSANOW, termios) == -1)
+    {
+	perror("tcsetattr");
+	return -1;
+    }
+    tcflush(fd, TCIFLUSH);
+
+    deadline = now_us() + window;
+    while (len < sizeof(buf) && (now = now_us()) < deadline)
+    {
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, (deadline - now + 999) / 1000) < 0)
+	{
+	    perror("poll");
+	    return -1;
+	}
+	if ((n = read(fd, buf + len, sizeof(buf) - len)) > 0)
+	    len += n;
+    }
+
+    /* PARMRK marks an error as \377 \0 <char> and escapes \377 */
+    memset(sc, 0, sizeof(*sc));
+    for (i = 0; i < len; i++)
+    {
+	if (buf[i] == 0377 && i + 1 < len)
+	{
+	    if (buf[++i] == 0)
 	    {
-		fprintf(stderr, "read stdin: EOF\n");
+		sc->errors++;
+		i++;
+	    }
+	    sc->bytes++;
+	    continue;
+	}
+	sc->bytes++;
+	if (isprint(buf[i]) || buf[i] == '\r' || buf[i] == '\n' ||
+	    buf[i] == '\t')
+	    sc->printable++;
+    }
+
+    return 0;
+}
+
+static int do_autobaud(char *args, int extra)
+{
+    struct termios orig_termios, termios;
+    struct autobaud_score sc;
+    const long *sp;
+    long best_speed = -1;
+    double score, best_score = 0;
+    long long deadline;
+    long timeout;
+    char *p;
+
+    if (*args == '?')
+    {
+	fprintf(stderr,
+		"Usage: autobaud [timeout]\n"
+		"Where timeout is the maximum time to search in seconds\n");
+	return 0;
+    }
+
+    timeout = 5;
+    if (*args)
+    {
+	timeout = strtol(args, &p, 10);
+	if (*p || timeout < 1)
+	{
+	    fprintf(stderr, "Invalid parameter, try \"autobaud ?\" for help\n");
+	    return 0;
+	}
+    }
+
+    if (term_fd == -1)
+    {
+	printf("No port selected\n");
+	return 0;
+    }
+
+    if (tcgetattr(term_fd, &orig_termios) == -1)
+    {
+	perror("tcgetattr");
+	return 0;
+    }
+    memcpy(&termios, &orig_termios, sizeof(termios));
+    termios.c_iflag &= ~IGNPAR;
+    termios.c_iflag |= PARMRK | INPCK;
+
+    deadline = now_us() + timeout * 1000000LL;
+    while (best_speed == -1 && now_us() < deadline)
+    {
+	for (sp = autobaud_speeds; *sp != -1; sp++)
+	{
+	    if (speed_to_code(*sp) == -1)
+		continue;
+
+	    if (autobaud_sample(term_fd, &termios, *sp, &sc) == -1)
+		break;
+	    if (sc.bytes == 0)
+		continue;
+
+	    score = (sc.printable - 4.0 * sc.errors) / sc.bytes;
+	    printf("    %7ld: %d bytes, %d framing errors, %d%% printable\n",
+		   *sp, sc.bytes, sc.errors, sc.printable * 100 / sc.bytes);
+
+	    if (score > best_score)
+	    {
+		best_score = score;
+		best_speed = *sp;
+	    }
+
+	    /* clean text, no need to look any further */
+	    if (sc.bytes >= 16 && sc.errors == 0 &&
+		sc.printable * 100 >= sc.bytes * 95)
+		break;
+	}
+    }
+
+    memcpy(&termios, &orig_termios, sizeof(termios));
+    if (best_speed != -1)
+    {
+	cfsetospeed(&termios, speed_to_code(best_speed));
+	cfsetispeed(&termios, speed_to_code(best_speed));
+    }
+    if (tcsetattr(term_fd, TCSANOW, &termios) == -1)
+    {
+	perror("tcsetattr");
+	return 0;
+    }
+
+    if (best_speed == -1)
+    {
+	printf("No speed found\n");
+	return 0;
+    }
+
+    printf("Speed set to %ld\n", best_speed);
+
+    return 1;
+}
+
+/************************************************************************/
+
+/* Background sessions.  "session <name>" forks a tt that keeps the
+   port, the log and the other settings and runs the connect loop
+   without a terminal, with a control socket that clients attach to.
+   Attached clients get the recent output and then everything shown,
+   and what they type is sent to the port. */
+
+static void session_path(const char *name, char *buf, size_t size)
+{
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+
+    if (dir && *dir)
+	snprintf(buf, size, "%s/tt-%s.sock", dir, name);
+    else
+	snprintf(buf, size, "/tmp/tt-%d-%s.sock", (int)getuid(), name);
+}
+
+static int ctl_connect(const char *path)
+{
+    struct sockaddr_un sa;
+    int fd;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strncpy(sa.sun_path, path, sizeof(sa.sun_path) - 1);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+	return -1;
+    if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == -1)
+    {
+	close(fd);
+	return -1;
+    }
+
+    return fd;
+}
+
+static int ctl_send(int fd, int type, const void *buf, int len)
+{
+    unsigned char hdr[CTL_HDR];
+    struct iovec iov[2];
+    uint32_t n = htonl(len);
+
+    hdr[0] = type;
+    memcpy(hdr + 1, &n, 4);
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = CTL_HDR;
+    iov[1].iov_base = (void *)buf;
+    iov[1].iov_len = len;
+
+    return writev(fd, iov, 2) == CTL_HDR + len ? 0 : -1;
+}
+
+/* Attach to a session, returns when detached or the session ends */
+static int attach(const char *name, const char *path)
+{
+    static unsigned char in[CTL_HDR + CTL_MAX];
+    int in_len = 0;
+    char buf[1024], data[1024];
+    int escape_seen = 0;
+    fd_set readfds;
+    uint32_t len;
+    int fd, n, i, k, p;
+
+    if ((fd = ctl_connect(path)) == -1)
+    {
+	fprintf(stderr, "no session \"%s\": %s\n", name, strerror(errno));
+	return 0;
+    }
+
+    if (ctl_send(fd, 'S', "", 0) == -1)
+    {
+	perror("write");
+	close(fd);
+	return 0;
+    }
+
+    fprintf(stderr, "Attached to session \"%s\", press \\%03o D to detach\n",
+	    name, escape_char);
+    setup_tty();
+
+    while (1)
+    {
+	FD_ZERO(&readfds);
+	FD_SET(0, &readfds);
+	FD_SET(fd, &readfds);
+
+	if (select(fd + 1, &readfds, NULL, NULL, NULL) < 0)
+	{
+	    perror("select");
+	    break;
+	}
+
+	if (FD_ISSET(0, &readfds))
+	{
+	    if ((n = read(0, buf, sizeof(buf))) <= 0)
+		break;
+
+	    for (i = k = 0; i < n; i++)
+	    {
+		if (!escape_seen && buf[i] == escape_char)
+		{
+		    escape_seen = 1;
+		    continue;
+		}
+		if (escape_seen)
+		{
+		    escape_seen = 0;
+		    if (tolower(buf[i]) == 'd')
+			goto detach;
+		    if (tolower(buf[i]) == 'k')
+		    {
+			ctl_send(fd, 'C', "quit", 4);
+			goto detach;
+		    }
+		    if (buf[i] != escape_char)
+		    {
+			restore_tty();
+			printf("\n"
+			       "\\%03o\tSend \\%03o\n"
+			       "d\tDetach from the session\n"
+			       "k\tEnd the session\n", escape_char, escape_char);
+			setup_tty();
+			continue;
+		    }
+		}
+		data[k++] = buf[i];
+	    }
+
+	    if (k && ctl_send(fd, 'D', data, k) == -1)
 		break;
+	}
+
+	if (FD_ISSET(fd, &readfds))
+	{
+	    if ((n = read(fd, in + in_len, sizeof(in) - in_len)) <= 0)
+	    {
+		restore_tty();
+		fprintf(stderr, "\nSession \"%s\" ended\n", name);
+		close(fd);
+		return 1;
+	    }
+	    in_len += n;
+
+	    for (p = 0; in_len - p >= CTL_HDR; p += CTL_HDR + len)
+	    {
+		memcpy(&len, in + p + 1, 4);
+		len = ntohl(len);
+		if (len > CTL_MAX || in_len - p < CTL_HDR + len)
+		    break;
+		if (in[p] == 'O' && write_all(1, in + p + CTL_HDR, len) == -1)
+		    goto detach;
 	    }
+	    memmove(in, in + p, in_len - p);
+	    in_len -= p;
+	}
+    }
+
+detach:
+    restore_tty();
+    fprintf(stderr, "\nDetached from session \"%s\"\n", name);
+    close(fd);
+
+    return 1;
+}
+
+static int do_session(char *args, int extra)
+{
+    char path[PATH_MAX];
+    pid_t pid;
+    int fd, i;
+
+    if (!*args || *args == '?' || strchr(args, '/'))
+    {
+	fprintf(stderr,
+		"Usage: session <name>\n"
+		"Keep the port open in a background session and attach to it,\n"
+		"attach again later with \"tt attach <name>\"\n");
+	return 0;
+    }
+
+    if (ctl_handling)
+    {
+	fprintf(stderr, "A session can not be started through the control socket\n");
+	return 0;
+    }
+
+    session_path(args, path, sizeof(path));
+
+    /* already running, just attach */
+    if ((fd = ctl_connect(path)) != -1)
+    {
+	close(fd);
+	return attach(args, path);
+    }
+
+    if (!term_name)
+    {
+	fprintf(stderr, "No port selected\n");
+	return 0;
+    }
+
+    /* the session takes over the control socket */
+    ctl_close();
+
+    if ((pid = fork()) == -1)
+    {
+	perror("fork");
+	return 0;
+    }
+
+    if (pid == 0)
+    {
+	setsid();
+	if ((fd = open("/dev/null", O_RDWR)) != -1)
+	{
+	    dup2(fd, 0);
+	    dup2(fd, 1);
+	    dup2(fd, 2);
+	    if (fd > 2)
+		close(fd);
+	}
+	signal(SIGHUP, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
+
+	session_mode = 1;
+	if (ctl_open(path) == -1)
+	    _exit(1);
+
+	while (1)
+	    if (!do_connect("", 0))
+		sleep(1);
+    }
+
+    /* the session owns the port and the log now */
+    if (term_fd != -1)
+	close(term_fd);
+    term_fd = -1;
+    free((void *)term_name);
+    term_name = NULL;
+    setenv("TT_PORT", "", 1);
+    if (log_fd != -1)
+	close(log_fd);
+    log_fd = -1;
+    if (log_ring)
+	munmap(log_ring, RING_DATA + log_ring->size);
+    log_ring = NULL;
+    if (clean_fd != -1)
+	close(clean_fd);
+    clean_fd = -1;
+    if (pty_fd != -1)
+    {
+	/* the pty and its link belong to the session now */
+	close(pty_fd);
+	close(pty_slave);
+	pty_fd = pty_slave = -1;
+	free(pty_link);
+	free(pty_name);
+	pty_link = pty_name = NULL;
+    }
+
+    /* wait for the session to start listening */
+    for (i = 0; i < 100; i++)
+    {
+	if ((fd = ctl_connect(path)) != -1)
+	{
+	    close(fd);
+	    return attach(args, path);
+	}
+	usleep(10000);
+    }
+
+    fprintf(stderr, "session \"%s\" did not start\n", args);
+
+    return 0;
+}
+
+/************************************************************************/
+
+static int do_shell(char *args, int extra)
+{
+    if (*args)
+	return system(args) == 0;
+    else
+	return system(getenv("SHELL")) == 0;
+}
+
+/************************************************************************/
+
+static int do_show(char *args, int extra)
+{
+    struct termios termios;
+    long speed;
+
+    printf("global settings:\n");
+    printf("    break-duration: %d (1/10 seconds)\n", break_duration);
+    printf("    escape-char: %d\n", escape_char);
+    printf("    timestamp: %s\n", flag_timestamp ? "on" : "off");
+    printf("    echo: %s\n", flag_echo ? "on" : "off");
+    printf("    translate rx: %s\n", xlat_rx.active ? xlat_rx.rules : "off");
+    printf("    translate tx: %s\n", xlat_tx.active ? xlat_tx.rules : "off");
+    if (pace_char_us || pace_line_ms)
+	printf("    pacing: %ld us per character, %ld ms per line\n",
+	       pace_char_us, pace_line_ms);
+    else
+	printf("    pacing: off\n");
+    if (log_fd == -1)
+	printf("    log: none\n");
+    else if (log_ring)
+	printf("    log: ring \"%s\", %llu of %llu bytes used, %lld written\n",
+	       log_name,
+	       (unsigned long long)(log_ring->head < log_ring->size
+				    ? log_ring->head : log_ring->size),
+	       (unsigned long long)log_ring->size, (long long)log_pos);
+    else
+	printf("    log: \"%s\", %lld bytes\n", log_name, (long long)log_pos);
+    if (clean_fd != -1)
+	printf("    clean log: \"%s\", %llu of %llu bytes kept, %llu sequences removed\n",
+	       clean_name, clean_out, clean_in, clean_removed);
+    if (log_sync_mode == LOG_SYNC_INTERVAL)
+	printf("    log sync: interval %ld ms, worst case window %ld ms\n",
+	       log_sync_ms, log_sync_ms);
+    else if (log_sync_mode == LOG_SYNC_BYTES)
+	printf("    log sync: bytes %ld, worst case window %ld bytes or 1000 ms\n",
+	       log_sync_bytes, log_sync_bytes);
+    else
+	printf("    log sync: none, worst case window unbounded\n");
+    if (log_stats.syncs)
+	printf("        %lu syncs, %.2f ms average, worst seen %.1f ms / %ld bytes\n",
+	       log_stats.syncs, log_stats.sync_us / 1000.0 / log_stats.syncs,
+	       log_stats.max_window_us / 1000.0, log_stats.max_unsynced);
+    printf("    framing: %s\n", framing->name);
+    if (framing != framings)
+	printf("        frames %lu, fcs errors %lu, aborts %lu, overruns %lu,"
+	       " text bytes %llu\n",
+	       frame_stats.frames, frame_stats.fcs_errors,
+	       frame_stats.aborts, frame_stats.overruns,
+	       frame_stats.text_bytes);
+    if (cap_name)
+	printf("    record: \"%s\", %llu bytes so far\n", cap_name, cap_bytes);
+    else
+	printf("    record: none\n");
+    if (cmp_golden)
+	printf("    golden: \"%s\", at line %ld of %ld, %lu matched, "
+	       "%lu unexpected, %lu missing\n",
+	       cmp_golden->name, cmp_pos, cmp_golden->n, cmp_matched,
+	       cmp_unexpected, cmp_missing);
+    if (pty_fd == -1)
+	printf("    pty: off\n");
+    else
+    {
+	printf("    pty: %s%s%s, %s", pty_name, pty_link ? " as " : "",
+	       pty_link ? pty_link : "", pty_exclusive ? "exclusive" : "shared");
+	if (pty_exclusive)
+	    printf(" (hold %ld ms)", pty_hold_ms);
+	printf(", %llu bytes in, %llu out, %llu dropped\n",
+	       pty_in, pty_out, pty_dropped);
+    }
+    printf("    uring: %s\n", flag_uring ? "on" : "off");
+    if (uring_stats.enters)
+	printf("        %lu reads, %lu log writes, %lu io_uring_enter calls\n",
+	       uring_stats.reads, uring_stats.writes, uring_stats.enters);
+    printf("    sequence: %s\n", seq_stored ? seq_stored : "none");
+    if (hist_size)
+	printf("    scrollback: %lu KiB, %llu bytes shown so far\n",
+	       (unsigned long)(hist_size / 1024), hist_head);
+    else
+	printf("    scrollback: off\n");
+    if (ctl_fd != -1)
+	printf("    control: \"%s\", %lu messages\n", ctl_path, ctl_messages);
+    else
+	printf("    control: off\n");
+    printf("    monitor: %s, changes CTS %lu, DSR %lu, DCD %lu, RI %lu\n",
+	   flag_monitor ? "on" : "off",
+	   mon_counts[0], mon_counts[1], mon_counts[2], mon_counts[3]);
+    printf("\n");
+
+    printf("port settings:\n");
+    if (term_fd == -1)
+	printf("    no port selected\n");
+    else
+    {
+	if (tcgetattr(term_fd, &termios) == -1)
+	{
+	    perror("tcgetattr");
+	    return 0;
+	}
 
-	    /* handle commands */
-	    if (escape_seen)
-	    {
-		escape_seen = 0;
+	speed = code_to_speed(cfgetispeed(&termios));
+	if (speed == -1)
+	    printf("    speed:  unknown\n");
+	else
+	    printf("    speed:  %ld\n", speed);
 
-		if (c == escape_char)
-		{
-		    if (term_fd != -1)
-		    {
-			n = write(term_fd, &c, 1);
-			if (n < 0)
-			{
-			    perror("write term_fd");
-			    break;
-			}
-			if (n == 0)
-			{
-			    fprintf(stderr, "write term_fd: buffer full?\n");
-			    break;
-			}
-			break;
-		    }
-		}
-		else /* if (c == escape_char) */
-		{
-		    switch (tolower(c))
-		    {
-		    case 'h':
-		    case '?':
-			restore_tty();
-			printf("\n"
-			 "\\%03o\tSend \\%03o\n"
-			     "h or ?\tShow this help message\n"
-			     "!\tStart a shell\n"
-			     "c\tReturn to the command line\n"
-			     "q\tQuit\n"
-			     "Command> ", escape_char, escape_char);
-			fflush(stdout);
-			setup_tty();
-			escape_seen = 1;
-			break;
+	if (termios.c_cflag & CRTSCTS)
+	    printf("    flow:   rtscts\n");
+	else
+	    printf("    flow:   none\n");
 
-		    case '!':
-			restore_tty();
-			puts("\nStarting a shell");
-			system(getenv("SHELL"));
-			puts("\nBack at the terminal");
-			setup_tty();
-			break;
+	if (termios.c_cflag & CLOCAL)
+	    printf("    modem:  off\n");
+	else
+	    printf("    modem:  on\n");
 
-		    case 'c':
-			term_close = 0;
-			goto do_close;
+	if (rs485_mode == RS485_OFF)
+	    printf("    rs485:  off\n");
+	else
+	    printf("    rs485:  %s, RTS %s while sending, %ld ms before,"
+		   " %ld ms after%s\n",
+		   rs485_mode == RS485_KERNEL ? "kernel" : "software",
+		   rs485_rts_low ? "low" : "high",
+		   rs485_before_ms, rs485_after_ms,
+		   rs485_rx_during_tx ? ", receiving while sending" : "");
+    }
+    printf("\n");
 
-		    case 'b':
-		    {
-			printf("break\n");
-			if (tcsendbreak(term_fd, break_duration) == -1)
-			    perror("break");
-			printf("break done\n");
-			break;
-		    }
+    return 1;
+}
 
-		    case 'q':
-		    {
-			restore_tty();
+/************************************************************************/
 
-			do_quit("", 0);
-			exit(0);
-		    }
+/* Loopback test.  A PRBS-15 pattern is sent through the port and
+   checked on receive.  The checker is self-synchronising, it predicts
+   each byte from the bytes actually received, so a lost byte only
+   causes a few errors and a single bit error is counted three times,
+   once directly and once for each feedback tap. */
 
-		    default:
-			write(1, &bell, 1);
-			break;
-		    }
-		}
-	    }
-	    else if (c == escape_char)
-		escape_seen = 1;
-	    else
-	    {
-	    retry_write:
-		if (term_fd != -1)
-		{
-		    n = write(term_fd, &c, 1);
-		    if (n < 0)
-		    {
-			if (errno == EAGAIN)
-			{
-			    usleep(1);
-			    goto retry_write;
-			}
-			fprintf(stderr, "write term_fd: %s (%d)\n",
-				strerror(errno), errno);
-			break;
-		    }
-		    if (n == 0)
-		    {
-			fprintf(stderr, "write term_fd: buffer full?\n");
-			break;
-		    }
-		}
-	    }
+#define LOOP_WINDOW	4096
+#define LOOP_SAMPLES	64
+
+struct loop_result
+{
+    unsigned long long tx;
+    unsigned long long rx;
+    unsigned long long checked;
+    unsigned long long byte_errors;
+    unsigned long long bit_errors;
+    long long lat_min, lat_max, lat_sum;
+    long lat_count;
+    double elapsed;
+};
+
+static inline unsigned char prbs15_next(unsigned int r)
+{
+    return ((r >> 7) ^ (r >> 6)) & 0xff;
+}
+
+static int loopback_run(int fd, int secs, int read_size, struct loop_result *res)
+{
+    static unsigned char tx_buf[1024];
+    static unsigned char rx_buf[65536];
+    struct { unsigned long long offset; long long t; } samples[LOOP_SAMPLES];
+    int sample_head = 0, sample_tail = 0;
+    unsigned int tx_r = 0x7fff;
+    unsigned int rx_r = 0;
+    int tx_len = 0, tx_pos = 0;
+    long long start, end, now, last_sample = 0;
+    struct pollfd pfd;
+    int i, n;
+
+    memset(res, 0, sizeof(*res));
+    res->lat_min = LLONG_MAX;
+    tcflush(fd, TCIOFLUSH);
+
+    start = now = now_us();
+    end = start + secs * 1000000LL;
+
+    /* after the sending stops, wait up to a second for stragglers */
+    while (now < end || (res->rx < res->tx && now < end + 1000000))
+    {
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	if (now < end && res->tx - res->rx < LOOP_WINDOW)
+	    pfd.events |= POLLOUT;
+
+	if (poll(&pfd, 1, 100) < 0)
+	{
+	    perror("poll");
+	    return -1;
 	}
+	now = now_us();
 
-	if (term_fd == -1)
+	if (pfd.revents & POLLOUT)
 	{
-	    if ((term_fd = open(term_name, O_RDWR | O_NONBLOCK)) != -1)
+	    if (tx_pos == tx_len)
 	    {
-		setup_term(term_fd);
-		restore_tty();
-		fprintf(stderr, "Connected, press \\%03o C to quit\n", escape_char);
-		setup_tty();
+		for (i = 0; i < sizeof(tx_buf); i++)
+		{
+		    tx_buf[i] = prbs15_next(tx_r);
+		    tx_r = (tx_r << 8) | tx_buf[i];
+		}
+		tx_len = sizeof(tx_buf);
+		tx_pos = 0;
 	    }
-	}
-	else if (FD_ISSET(term_fd, &readfds))
-	{
-	    char buf[1024];
-	    int n = read(term_fd, buf, sizeof(buf));
-	    if (n < 0)
+
+	    n = tx_len - tx_pos;
+	    if (n > LOOP_WINDOW - (res->tx - res->rx))
+		n = LOOP_WINDOW - (res->tx - res->rx);
+	    if ((n = write(fd, tx_buf + tx_pos, n)) < 0 && errno != EAGAIN)
 	    {
-		perror("read term_fd");
-		break;
+		perror("write");
+		return -1;
 	    }
-	    if (n == 0)
+	    if (n > 0)
 	    {
-		fprintf(stderr, "read term_fd: EOF\n");
-		break;
+		tx_pos += n;
+		res->tx += n;
+
+		/* remember when the last byte was sent, a few times a second */
+		if (now - last_sample > 10000 &&
+		    (sample_head + 1) % LOOP_SAMPLES != sample_tail)
+		{
+		    samples[sample_head].offset = res->tx;
+		    samples[sample_head].t = now;
+		    sample_head = (sample_head + 1) % LOOP_SAMPLES;
+		    last_sample = now;
+		}
 	    }
-	    if (write(1, buf, n) != n)
+	}
+
+	if (pfd.revents & (POLLIN | POLLERR | POLLHUP))
+	{
+	    if ((n = read(fd, rx_buf, read_size)) < 0 && errno != EAGAIN)
 	    {
-		perror("write stdout");
-		break;
+		perror("read");
+		return -1;
 	    }
-	    if (log_fd)
-		write(log_fd, buf, n);
-	    if (flag_hex)
+
+	    for (i = 0; i < n; i++)
 	    {
-		int i;
-		char s[16];
-		for (i = 0; i < n; i++)
+		unsigned char expected = prbs15_next(rx_r);
+
+		/* the first two bytes fill the history */
+		if (res->rx + i >= 2)
 		{
-		    sprintf(s, "[%02x]", buf[i]);
-		    write(1, s, 4);
+		    res->checked++;
+		    if (rx_buf[i] != expected)
+		    {
+			res->byte_errors++;
+			res->bit_errors += __builtin_popcount(rx_buf[i] ^ expected);
+		    }
 		}
-		write(1, "\r\n", 2);
+		rx_r = (rx_r << 8) | rx_buf[i];
 	    }
-	}
-    }
-
-do_close:
-    restore_tty();
 
-    if (term_close)
-    {
-	if (term_fd != -1)
-	{
-	    close(term_fd);
-	    term_fd = -1;
+	    if (n > 0)
+		res->rx += n;
 
-	    goto reconnect;
+	    while (sample_tail != sample_head &&
+		   samples[sample_tail].offset <= res->rx)
+	    {
+		long long lat = now - samples[sample_tail].t;
+
+		if (lat < res->lat_min)
+		    res->lat_min = lat;
+		if (lat > res->lat_max)
+		    res->lat_max = lat;
+		res->lat_sum += lat;
+		res->lat_count++;
+		sample_tail = (sample_tail + 1) % LOOP_SAMPLES;
+	    }
 	}
     }
 
-    fprintf(stderr, "\nBack at command prompt\n");
+    res->elapsed = (now - start) / 1e6;
 
-    return 1;
+    return 0;
 }
 
-/************************************************************************/
-
-static int do_log(char *args, int extra)
+static int parse_list(char *s, long *vals, int max)
 {
-    char *fn;
-    int flags;
+    char *p;
+    int n;
 
-    if (!*args || *args == '?')
+    for (n = 0; n < max && *s; n++)
     {
-	fprintf(stderr, "Usage: log overwrite|append|stop <filename>\n");
-	return 0;
+	vals[n] = strtol(s, &p, 10);
+	if (p == s || (*p && *p != ','))
+	    return -1;
+	s = *p ? p + 1 : p;
     }
 
-    if (log_fd == -1 && fuzzy("stop", args, &fn))
+    return *s ? -1 : n;
+}
+
+static int do_test_loopback(char *args, int extra)
+{
+    struct termios orig_termios, termios;
+    struct loop_result res;
+    long speeds[32], reads[32], flows[2];
+    int n_speeds = 0, n_reads = 1, n_flows = 0;
+    long secs = 2;
+    int flag_pty = 0;
+    int fd = term_fd;
+    int pty_fd = -1;
+    pid_t echo_pid = -1;
+    char *tok, *val;
+    int is, ir, iff;
+    int ok = 1;
+
+    if (*args == '?')
     {
-	printf("No log active\n");
-	return 1;
+	fprintf(stderr,
+		"Usage: test loopback [time <seconds>] [speed <speed>,...]\n"
+		"                     [flow none|rtscts|both] [read <size>,...] [pty]\n"
+		"Connect TX to RX on the port, or use \"pty\" to test against a\n"
+		"local pty pair that echoes everything back\n");
+	return 0;
     }
 
-    if (log_fd != -1)
+    reads[0] = 1024;
+    for (tok = strtok(args, " \t"); tok; tok = strtok(NULL, " \t"))
     {
-	fprintf(stderr, "Logging stopped\n");
-	close(log_fd);
-	log_fd = -1;
+	if (strcasecmp(tok, "pty") == 0)
+	{
+	    flag_pty = 1;
+	    continue;
+	}
+
+	if ((val = strtok(NULL, " \t")) == NULL)
+	    goto invalid;
+
+	if (strcasecmp(tok, "time") == 0)
+	{
+	    if ((secs = atol(val)) < 1)
+		goto invalid;
+	}
+	else if (strcasecmp(tok, "speed") == 0)
+	{
+	    if ((n_speeds = parse_list(val, speeds, 32)) < 1)
+		goto invalid;
+	    for (is = 0; is < n_speeds; is++)
+		if (speed_to_code(speeds[is]) == -1)
+		    goto invalid;
+	}
+	else if (strcasecmp(tok, "read") == 0)
+	{
+	    if ((n_reads = parse_list(val, reads, 32)) < 1)
+		goto invalid;
+	    for (ir = 0; ir < n_reads; ir++)
+		if (reads[ir] < 1 || reads[ir] > 65536)
+		    goto invalid;
+	}
+	else if (strcasecmp(tok, "flow") == 0)
+	{
+	    n_flows = 0;
+	    if (strcasecmp(val, "none") == 0 || strcasecmp(val, "both") == 0)
+		flows[n_flows++] = 0;
+	    if (strcasecmp(val, "rtscts") == 0 || strcasecmp(val, "both") == 0)
+		flows[n_flows++] = CRTSCTS;
+	    if (n_flows == 0)
+		goto invalid;
+	}
+	else
+	    goto invalid;
     }
 
-    if (fuzzy("stop", args, &fn))
-	return 1;
+    if (flag_pty)
+    {
+	if ((pty_fd = open_pty(&fd)) == -1)
+	    return 0;
 
-    if (!fn)
-	fn = "tt.log";
+	if ((echo_pid = fork()) == 0)
+	{
+	    char buf[4096];
+	    int n;
 
-    if (fuzzy("overwrite", args, &fn))
-	flags = O_CREAT | O_TRUNC | O_WRONLY;
-    else if (fuzzy("append", args, &fn))
-	flags = O_CREAT | O_APPEND | O_WRONLY;
-    else
+	    while ((n = read(pty_fd, buf, sizeof(buf))) > 0)
+		if (write_all(pty_fd, buf, n) == -1)
+		    break;
+	    _exit(0);
+	}
+	if (echo_pid == -1)
+	{
+	    perror("fork");
+	    close(pty_fd);
+	    close(fd);
+	    return 0;
+	}
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+    }
+    else if (term_fd == -1)
     {
-	fprintf(stderr, "Invalid parameter, try \"log ?\" for help\n");
+	printf("No port selected\n");
 	return 0;
     }
 
-    log_fd = open(fn, flags, 0777);
-    if (log_fd == -1)
-    {
-	fprintf(stderr,
-		"failed to open \"%s\" for logging: %s\n",
-		fn, strerror(errno));
-	return 0;
-    }
+    if (tcgetattr(fd, &orig_termios) == -1)
+    {
+	perror("tcgetattr");
+	ok = 0;
+	goto out;
+    }
+
+    if (n_speeds == 0)
+	speeds[n_speeds++] = code_to_speed(cfgetospeed(&orig_termios));
+    if (n_flows == 0)
+	flows[n_flows++] = orig_termios.c_cflag & CRTSCTS;
+
+    printf("%8s %6s %5s %10s %9s %5s %20s %10s %10s %9s\n",
+	   "speed", "flow", "read", "bytes", "bytes/s", "eff%",
+	   "latency ms min/avg/max", "lost", "byte err", "ber");
+
+    for (is = 0; is < n_speeds; is++)
+	for (iff = 0; iff < n_flows; iff++)
+	    for (ir = 0; ir < n_reads; ir++)
+	    {
+		memcpy(&termios, &orig_termios, sizeof(termios));
+		cfsetospeed(&termios, speed_to_code(speeds[is]));
+		cfsetispeed(&termios, speed_to_code(speeds[is]));
+		termios.c_cflag &= ~CRTSCTS;
+		termios.c_cflag |= flows[iff];
+		if (tcsetattr(fd, TCSANOW, &termios) == -1)
+		{
+		    perror("tcsetattr");
+		    ok = 0;
+		    goto out;
+		}
+
+		if (loopback_run(fd, secs, reads[ir], &res) == -1)
+		{
+		    ok = 0;
+		    goto out;
+		}
+
+		printf("%8ld %6s %5ld %10llu %9.0f %5.1f %6.1f/%6.1f/%6.1f %10llu %10llu %9.2e\n",
+		       speeds[is], flows[iff] ? "rtscts" : "none", reads[ir],
+		       res.rx, res.rx / res.elapsed,
+		       speeds[is] ? 100.0 * res.rx / res.elapsed / (speeds[is] / 10.0) : 0,
+		       res.lat_count ? res.lat_min / 1000.0 : 0,
+		       res.lat_count ? res.lat_sum / 1000.0 / res.lat_count : 0,
+		       res.lat_max / 1000.0,
+		       res.tx - res.rx, res.byte_errors,
+		       res.checked ? res.bit_errors / 3.0 / (res.checked * 8) : 0);
+		fflush(stdout);
+	    }
+
+out:
+    tcsetattr(fd, TCSANOW, &orig_termios);
+    if (flag_pty)
+    {
+	if (echo_pid > 0)
+	{
+	    kill(echo_pid, SIGTERM);
+	    waitpid(echo_pid, NULL, 0);
+	}
+	close(pty_fd);
+	close(fd);
+    }
+
+    return ok;
+
+invalid:
+    fprintf(stderr, "Invalid parameter, try \"test loopback ?\" for help\n");
+    return 0;
+}
+
+/************************************************************************/
+
+struct command
+{
+    const char *name;
+    int (*func)(char *args, int extra);
+    const char *help;
+    int abbrev;			/* shortest abbreviation of the last word */
+};
+
+static struct command commands[] =
+{
+    { "autobaud",	do_autobaud,	"autobaud [timeout]" },
+    { "connect",	do_connect,	"connect" },
+    { "golden",		do_golden,	"golden <golden log>|stop|mask <regex>|mask off" },
+    { "help",		do_help,	"help or ?" },
+    { "log",		do_log,		"log overwrite|append|stop [filename]" },
+    { "pulse",		do_pulse,	"pulse dtr|rts|break <ms>" },
+    { "quit",		do_quit,	"quit" },
+    { "record",		do_record,	"record <filename> [until <pattern>|bytes <n>]" },
+    { "sequence",	do_sequence,	"sequence [<step>...]", 3 },
+    { "session",	do_session,	"session <name>", 3 },
+    { "set ?",		do_set_help,	NULL },
+    { "set break",	do_set_break,	"set break <duration>" },
+    { "set control",	do_set_control,	"set control <path>|off" },
+    { "set echo",	do_set_echo,	"set echo on|off", 2 },
+    { "set escape",	do_set_escape,	"set escape <character>" },
+    { "set flow",	do_set_flow,	"set flow rtscts|none" },
+    { "set framing",	do_set_framing,	"set framing none|slip|cobs|hdlc", 2 },
+    { "set hex",	do_set_hex,	"set hex on|off" },
+    { "set modem",	do_set_modem,	"set modem on|off" },
+    { "set nlcr",	do_set_nlcr,	"set speed on|off" },
+    { "set monitor",	do_set_monitor,	"set monitor on|off", 3 },
+    { "set pacing",	do_set_pacing,	"set pacing char <us>|line <ms>|off", 2 },
+    { "set port",	do_set_port,	"set port <device>" },
+    { "set sequence",	do_set_sequence, "set sequence <step>...", 2 },
+    { "set scrollback",	do_set_scrollback, "set scrollback <size>|off", 2 },
+    { "set pty",	do_set_pty,	"set pty on|<link>|off [exclusive [<hold ms>]]", 2 },
+    { "set rs485",	do_set_rs485,	"set rs485 off|on [low] [before <ms>] [after <ms>] [rxtx] [software]", 2 },
+    { "set rts",	do_set_rts,	"set rts on|off" },
+    { "set dtr",	do_set_dtr,	"set dtr on|off" },
+    { "set speed",	do_set_speed,	"set speed <speed>" },
+    { "set timestamp",	do_set_timestamp, "set timestamp on|off" },
+    { "set translate",	do_set_translate, "set translate rx|tx <rule>...|off" },
+    { "set uring",	do_set_uring,	"set uring on|off" },
+    { "shell",		do_shell,	"shell [command] or ![command]" },
+    { "show",		do_show,	"show" },
+    { "test loopback",	do_test_loopback, "test loopback [options]" },
+
+    { NULL },
+};
 
-    fprintf(stderr, "Logging started to \"%s\"\n", fn);
+static int do_help(char *args, int extra)
+{
+    struct command *cmd;
+    char *dummy;
 
-    return 1;
+    for (cmd = commands; cmd->name; cmd++)
+	if (fuzzy(cmd->name, args, &dummy) && cmd->help)
+	    printf("    %s\n", cmd->help);
+    printf("\n");
+    return 0;
 }
 
-/************************************************************************/
+static int do_set_help(char *args, int extra)
+{
+    struct command *cmd;
+    char *dummy;
 
-static int do_quit(char *args, int extra)
+    for (cmd = commands; cmd->name; cmd++)
+	if (fuzzy(cmd->name, "set", &dummy) && cmd->help)
+	    printf("    %s\n", cmd->help);
+    printf("\n");
+    return 0;
+}
+
+/* Newer commands need a longer abbreviation so that the older ones
+   keep their short forms */
+static int command_match(const struct command *cmd, char *s, char **args)
 {
-    if (term_fd != -1)
-	close(term_fd);
+    const char *p;
+    int len;
 
-    if (log_fd != -1)
+    if (!fuzzy(cmd->name, s, args))
+	return 0;
+    if (!cmd->abbrev)
+	return 1;
+
+    /* find the input word for the last word of the name */
+    for (p = strchr(cmd->name, ' '); p; p = strchr(p + 1, ' '))
     {
-	printf("Logging stopped\n");
-	close(log_fd);
+	while (*s && !isspace(*s))
+	    ++s;
+	while (*s && isspace(*s))
+	    ++s;
     }
+    for (len = 0; s[len] && !isspace(s[len]); len++)
+	;
 
-    printf("Bye!\n");
-    exit(1);
+    return len == 0 || len >= cmd->abbrev;
 }
 
-/************************************************************************/
-
-static int do_set_break(char *args, int extra)
+static int handle(char *s)
 {
-    long t;
     char *p;
+    struct command *cmd;
+    struct command *match;
+    char *args;
 
-    if (!*args || *args == '?')
-    {
-	fprintf(stderr,
-		"Usage: set break <duration>\n"
-		"Where duration is in 1/10 seconds from 1 to 50\n");
-	return 0;
-    }
+    /* strip whitespace on the left */
+    while (*s && isspace(*s))
+	s++;
 
-    t = strtol(args, &p, 10);
-    while (*p && isspace(*p))
-	++p;
+    /* strip whitespace on the right */
+    p = s + strlen(s) - 1;
+    while (p > s && isspace(*p))
+	*p-- = '\0';
 
-    if (*p || t < 1)
+    /* no command */
+    if (!*s)
+	return 1;
+
+    /* special commands */
+    if (*s == '?')
+	return do_help(s+1, 0);
+
+    if (*s == '!')
+	return do_shell(s+1, 0);
+
+    match = NULL;
+    args = NULL;
+    for (cmd = commands; cmd->name; cmd++)
     {
-	fprintf(stderr,
-		"Invalid parameter, try \"set break ?\" for help\n");
-	return 0;
+	if (command_match(cmd, s, &args))
+	{
+	    if (match)
+	    {
+		/* already have a match, so this is ambiguous */
+		printf("ambiguous command, the following commands match:\n");
+		for (cmd = commands; cmd->name; cmd++)
+		    if (command_match(cmd, s, &args) && cmd->help)
+			printf("    %s\n", cmd->help);
+		printf("\n");
+		return 0;
+	    }
+	    match = cmd;
+	}
     }
 
-    break_duration = t;
+    if (match)
+	return match->func(args, 0);
 
-    return 1;
-}
+    printf("unknown command '%s'\n", s);
 
-/************************************************************************/
+    return 0;
+}
 
-static int do_set_escape(char *args, int extra)
+static int script(const char *name)
 {
-    long c;
-    char *p;
+    FILE *fp;
+    char fn[FILENAME_MAX];
+    char s[256];
+    int line;
 
-    if (!*args || *args == '?')
+    snprintf(fn, sizeof(fn)-1, "%s/.tt/%s", getenv("HOME"), name);
+    fn[sizeof(fn)-1] = '\0';
+
+    if ((fp = fopen(fn, "r")) == NULL)
     {
-	fprintf(stderr,
-		"Usage: set escape <character>\n"
-	       "Where character is an ASCII value from 0 to 255\n");
+	fprintf(stderr, "could not run script \"%s\": %s\n",
+		fn, strerror(errno));
 	return 0;
     }
 
-    c = strtoul(args, &p, 10);
-    while (*p && isspace(*p))
-	++p;
+    fprintf(stderr, "Running script \"%s\"\n", fn);
 
-    if (*p || c < 0 || c > 255)
+    line = 0;
+    while (fgets(s, sizeof(s), fp) != NULL)
     {
-	fprintf(stderr, "Invalid parameter, try \"set escape ?\" for help\n");
-	return 0;
+	line++;
+	fputs(s, stdout);
+	if (!handle(s))
+	{
+	    fprintf(stderr, "%s: error at line %d, aborting script\n", name, line);
+	    fclose(fp);
+	    return 0;
+	}
     }
 
-    escape_char = c;
+    fclose(fp);
 
     return 1;
 }
 
 /************************************************************************/
 
-static int do_set_flow(char *args, int extra)
+/* Parse a count given to a command line option, -1 if it is not one */
+static long opt_count(const char *s)
 {
-    struct termios termios;
-    char *space;
-    int flags;
+    char *end;
+    long n;
 
-    if (!*args || *args == '?')
+    errno = 0;
+    n = strtol(s, &end, 10);
+    if (end == s || *end || errno || n < 0)
+	return -1;
+    return n;
+}
+
+/* Replay a log to stdout or to a new pty.  Lines of a timestamped log
+   are written with their original timing, optionally scaled, lines
+   without a timestamp are written at the given line speed or as fast
+   as possible. */
+
+static int tool_replay(int argc, char *argv[])
+{
+    FILE *fp;
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    static char out[65536];
+    int out_len = 0;
+    int out_fd = 1;
+    int slave_fd = -1;
+    int flag_fast = 0;
+    int flag_pty = 0;
+    double scale = 1.0;
+    long bps = 0;
+    long long ts, ts0 = -1;
+    long long start, deadline;
+    unsigned long long bytes = 0;
+    unsigned long lines = 0;
+    double elapsed;
+    int k, c;
+
+    while ((c = getopt(argc, argv, "fs:b:p")) != -1)
     {
-	fprintf(stderr, "Usage: set flow rtscts|none\n");
-	return 0;
+	switch (c)
+	{
+	case 'f':
+	    flag_fast = 1;
+	    break;
+	case 's':
+	    scale = atof(optarg);
+	    break;
+	case 'b':
+	    bps = atol(optarg);
+	    break;
+	case 'p':
+	    flag_pty = 1;
+	    break;
+	default:
+	    optind = argc;
+	    break;
+	}
     }
 
-    space = args;
-    while (*space && !isspace(*space))
-	++space;
-
-    if (strncasecmp(args, "none", space-args) == 0)
-	flags = 0;
-    else if (strncasecmp(args, "rtscts", space-args) == 0)
-	flags = CRTSCTS;
-    else
+    if (optind != argc - 1 || scale <= 0 || bps < 0)
     {
-	fprintf(stderr, "Invalid parameter, try \"set flow ?\" for help\n");
+	fprintf(stderr,
+		"Usage: tt replay [-f] [-s <scale>] [-b <speed>] [-p] <log>\n"
+		"    -f  replay as fast as possible\n"
+		"    -s  speed up timestamped logs by this factor\n"
+		"    -b  line speed for lines without a timestamp\n"
+		"    -p  replay to a new pty instead of stdout\n");
 	return 0;
     }
 
-    if (term_fd == -1)
+    if ((fp = fopen(argv[optind], "r")) == NULL)
     {
-	printf("No port selected\n");
+	fprintf(stderr, "failed to open \"%s\": %s\n",
+		argv[optind], strerror(errno));
 	return 0;
     }
 
-    if (tcgetattr(term_fd, &termios) == -1)
+    if (flag_pty)
     {
-	perror("tcgetattr");
-	return 0;
+	char buf[sizeof(struct inotify_event) + NAME_MAX + 1];
+	int in_fd;
+
+	if ((out_fd = open_pty(&slave_fd)) == -1)
+	    return 0;
+
+	/* wait for a client to open the pty */
+	fprintf(stderr, "Replaying to \"%s\", waiting for a client\n",
+		ptsname(out_fd));
+	if ((in_fd = inotify_init()) == -1 ||
+	    inotify_add_watch(in_fd, ptsname(out_fd), IN_OPEN) == -1 ||
+	    read(in_fd, buf, sizeof(buf)) <= 0)
+	{
+	    perror("inotify");
+	    return 0;
+	}
+	close(in_fd);
     }
 
-    termios.c_cflag &= ~CRTSCTS;
-    termios.c_cflag |= flags;
+    start = now_us();
+    while ((len = getline(&line, &size, fp)) > 0)
+    {
+	k = parse_timestamp(line, &ts);
+	deadline = -1;
+	if (flag_fast)
+	    ;
+	else if (k)
+	{
+	    if (ts0 == -1)
+		ts0 = ts;
+	    deadline = start + (long long)((ts - ts0) / scale);
+	}
+	else if (bps)
+	    deadline = start + (long long)(bytes * 10 * 1000000.0 / bps);
 
-    if (tcsetattr(term_fd, TCSANOW, &termios) == -1)
+	if (deadline != -1 || out_len + len - k > sizeof(out))
+	{
+	    if (write_all(out_fd, out, out_len) == -1)
+		break;
+	    out_len = 0;
+	}
+	if (deadline != -1)
+	    sleep_until_us(deadline);
+
+	if (len - k > sizeof(out))
+	{
+	    if (write_all(out_fd, line + k, len - k) == -1)
+		break;
+	}
+	else
+	{
+	    memcpy(out + out_len, line + k, len - k);
+	    out_len += len - k;
+	}
+	bytes += len - k;
+	lines++;
+    }
+
+    if (len > 0 || write_all(out_fd, out, out_len) == -1)
+	perror("write");
+
+    elapsed = (now_us() - start) / 1e6;
+    fprintf(stderr, "Replayed %llu bytes, %lu lines in %.3f s (%.1f MB/s)\n",
+	    bytes, lines, elapsed, elapsed > 0 ? bytes / elapsed / 1e6 : 0);
+
+    /* let the client read what is still queued in the pty */
+    if (slave_fd != -1)
     {
-	perror("tcsetattr");
-	return 0;
+	int n;
+
+	while (ioctl(slave_fd, FIONREAD, &n) == 0 && n > 0)
+	    usleep(10000);
     }
 
+    free(line);
+    fclose(fp);
+
     return 1;
 }
 
 /************************************************************************/
 
-static int do_set_nlcr(char *args, int extra)
-{
-    char *space;
+/* Merge timestamped logs into one stream ordered by time.  Only the
+   current line of each log is kept in memory, and a binary heap of
+   the logs keyed on that line's timestamp picks the next line to
+   write.  Each line is written with its timestamp and a tag saying
+   which log it came from.  Lines without a timestamp get the one of
+   the line before them. */
 
-    if (!*args || *args == '?')
-    {
-	fprintf(stderr, "Usage: set nlcr on|off\n");
-	return 0;
-    }
+struct merge_source
+{
+    const char *tag;
+    FILE *fp;
+    char *line;
+    size_t size;
+    ssize_t len;
+    int skip;			/* length of the timestamp prefix */
+    long long ts;
+};
 
-    space = args;
-    while (*space && !isspace(*space))
-	++space;
+static int merge_next(struct merge_source *src)
+{
+    long long ts;
 
-    if (space-args > 1 && strncasecmp(args, "on", space-args) == 0)
-	flag_nlcr = 1;
-    else if (space-args > 1 && strncasecmp(args, "off", space-args) == 0)
-	flag_nlcr = 0;
-    else
-    {
-	fprintf(stderr, "Invalid parameter, try \"set nlcr ?\" for help\n");
+    if ((src->len = getline(&src->line, &src->size, src->fp)) <= 0)
 	return 0;
-    }
-
+    if ((src->skip = parse_timestamp(src->line, &ts)) != 0)
+	src->ts = ts;
     return 1;
 }
 
-/************************************************************************/
+static int merge_less(struct merge_source *a, struct merge_source *b)
+{
+    /* keep lines with the same timestamp in command line order */
+    return a->ts < b->ts || (a->ts == b->ts && a < b);
+}
 
+static void merge_sift(struct merge_source **heap, int n, int i)
+{
+    struct merge_source *t;
+    int c;
 
-static int do_set_modem(char *args, int extra)
+    while ((c = 2 * i + 1) < n)
+    {
+	if (c + 1 < n && merge_less(heap[c + 1], heap[c]))
+	    c++;
+	if (!merge_less(heap[c], heap[i]))
+	    break;
+	t = heap[i];
+	heap[i] = heap[c];
+	heap[c] = t;
+	i = c;
+    }
+}
+
+static int tool_merge(int argc, char *argv[])
 {
-    struct termios termios;
-    char *space;
-    int flags;
+    struct merge_source *srcs, **heap, *src;
+    const char *out_fn = NULL;
+    FILE *out = stdout;
+    unsigned long long lines = 0;
+    int n, i, c;
+    char *eq;
+
+    while ((c = getopt(argc, argv, "o:")) != -1)
+    {
+	switch (c)
+	{
+	case 'o':
+	    out_fn = optarg;
+	    break;
+	default:
+	    optind = argc;
+	    break;
+	}
+    }
 
-    if (!*args || *args == '?')
+    if (optind >= argc)
     {
-	fprintf(stderr, "Usage: set modem on|off\n");
+	fprintf(stderr,
+		"Usage: tt merge [-o <output>] [<tag>=]<log>...\n"
+		"Where the tag defaults to the name of the log\n");
 	return 0;
     }
 
-    space = args;
-    while (*space && !isspace(*space))
-	++space;
-
-    if (space-args > 1 && strncasecmp(args, "on", space-args) == 0)
-	flags = HUPCL;
-    else if (space-args > 1 && strncasecmp(args, "off", space-args) == 0)
-	flags = CLOCAL;
-    else
+    n = argc - optind;
+    srcs = calloc(n, sizeof(*srcs));
+    heap = calloc(n, sizeof(*heap));
+    if (!srcs || !heap)
     {
-	fprintf(stderr, "Invalid parameter, try \"set modem ?\" for help\n");
+	perror("calloc");
 	return 0;
     }
 
-    if (term_fd == -1)
+    for (i = 0; i < n; i++)
     {
-	printf("No port selected\n");
-	return 0;
+	const char *fn = argv[optind + i];
+
+	srcs[i].tag = fn;
+	if ((eq = strchr(fn, '=')) != NULL)
+	{
+	    *eq = '\0';
+	    fn = eq + 1;
+	}
+	else if (strrchr(fn, '/'))
+	    srcs[i].tag = strrchr(fn, '/') + 1;
+
+	if ((srcs[i].fp = fopen(fn, "r")) == NULL)
+	{
+	    fprintf(stderr, "failed to open \"%s\": %s\n",
+		    fn, strerror(errno));
+	    return 0;
+	}
+	setvbuf(srcs[i].fp, NULL, _IOFBF, 1 << 20);
     }
 
-    if (tcgetattr(term_fd, &termios) == -1)
+    if (out_fn && (out = fopen(out_fn, "w")) == NULL)
     {
-	perror("tcgetattr");
+	fprintf(stderr, "failed to open \"%s\": %s\n",
+		out_fn, strerror(errno));
 	return 0;
     }
+    setvbuf(out, NULL, _IOFBF, 1 << 20);
 
-    termios.c_cflag &= ~(CLOCAL|HUPCL);
-    termios.c_cflag |= flags;
+    c = 0;
+    for (i = 0; i < n; i++)
+	if (merge_next(&srcs[i]))
+	    heap[c++] = &srcs[i];
+    n = c;
+    for (i = n / 2 - 1; i >= 0; i--)
+	merge_sift(heap, n, i);
 
-    if (tcsetattr(term_fd, TCSANOW, &termios) == -1)
+    while (n)
     {
-	perror("tcsetattr");
+	src = heap[0];
+
+	fprintf(out, "[%lld.%06lld] %s: ",
+		src->ts / 1000000, src->ts % 1000000, src->tag);
+	fwrite(src->line + src->skip, 1, src->len - src->skip, out);
+	if (src->line[src->len - 1] != '\n')
+	    putc('\n', out);
+	lines++;
+
+	if (!merge_next(src))
+	    heap[0] = heap[--n];
+	merge_sift(heap, n, 0);
+    }
+
+    if (fflush(out) == EOF)
+    {
+	perror("write");
 	return 0;
     }
 
+    fprintf(stderr, "Merged %llu lines from %d logs\n", lines, argc - optind);
+
     return 1;
 }
 
 /************************************************************************/
 
-static int do_set_hex(char *args, int extra)
+/* Send commands or data to the control socket of a running tt */
+
+static int tool_ctl(int argc, char *argv[])
 {
-    struct termios termios;
-    char *space;
-    int flags;
+    int flag_data = 0;
+    int fd, c, i, n;
+    int ok = 1;
 
-    if (!*args || *args == '?')
+    while ((c = getopt(argc, argv, "d")) != -1)
     {
-	fprintf(stderr, "Usage: set hex on|off\n");
-	return 0;
+	if (c == 'd')
+	    flag_data = 1;
+	else
+	    optind = argc + 1;
     }
 
-    space = args;
-    while (*space && !isspace(*space))
-	++space;
-
-    if (space-args > 1 && strncasecmp(args, "on", space-args) == 0)
-	flags = HUPCL;
-    else if (space-args > 1 && strncasecmp(args, "off", space-args) == 0)
-	flags = CLOCAL;
-    else
+    if (optind >= argc)
     {
-	fprintf(stderr, "Invalid parameter, try \"set hex ?\" for help\n");
+	fprintf(stderr,
+		"Usage: tt ctl [-d] <socket> <command>...\n"
+		"    -d  send the arguments as data to the port, with\n"
+		"        \\r, \\n, \\t and \\xNN escapes\n");
 	return 0;
     }
 
-    if (term_fd == -1)
+    if ((fd = ctl_connect(argv[optind])) == -1)
     {
-	printf("No port selected\n");
+	fprintf(stderr, "failed to connect to \"%s\": %s\n",
+		argv[optind], strerror(errno));
 	return 0;
     }
 
-    if (tcgetattr(term_fd, &termios) == -1)
+    /* send everything first, then collect the acknowledgements */
+    for (i = optind + 1; i < argc; i++)
     {
-	perror("tcgetattr");
-	return 0;
+	n = flag_data ? unescape(argv[i]) : strlen(argv[i]);
+	if (ctl_send(fd, flag_data ? 'D' : 'C', argv[i], n) == -1)
+	{
+	    perror("write");
+	    return 0;
+	}
     }
 
-    termios.c_cflag &= ~(CLOCAL|HUPCL);
-    termios.c_cflag |= flags;
-
-    if (tcsetattr(term_fd, TCSANOW, &termios) == -1)
+    for (i = optind + 1; i < argc; i++)
     {
-	perror("tcsetattr");
-	return 0;
+	unsigned char reply[CTL_HDR + 1];
+
+	for (n = 0; n < sizeof(reply); n += c)
+	    if ((c = read(fd, reply + n, sizeof(reply) - n)) <= 0)
+	    {
+		fprintf(stderr, "control socket closed\n");
+		return 0;
+	    }
+	if (reply[0] != 'A' || !reply[CTL_HDR])
+	{
+	    fprintf(stderr, "failed: %s\n", argv[i]);
+	    ok = 0;
+	}
     }
 
-    return 1;
+    close(fd);
+
+    return ok;
 }
 
 /************************************************************************/
 
-static int do_set_port(char *args, int extra)
+static int tool_attach(int argc, char *argv[])
 {
-    if (!*args || *args == '?')
-    {
-	printf("Usage: set port <device>\n");
-	return 0;
-    }
-
-    free((void *)term_name);
-    term_name = NULL;
-    setenv("TT_PORT", "", 1);
+    char path[PATH_MAX];
 
-    if (term_fd != -1)
-	close(term_fd);
-
-    if ((term_fd = open(args, O_RDWR | O_NONBLOCK)) == -1)
+    if (argc != 2)
     {
-	fprintf(stderr, "failed to open %s: %s\n", args, strerror(errno));
+	fprintf(stderr, "Usage: tt attach <session>\n");
 	return 0;
     }
 
-    term_name = strdup(args);
-    setenv("TT_PORT", args, 1);
-
-    setup_term(term_fd);
+    session_path(argv[1], path, sizeof(path));
 
-    return 1;
+    return attach(argv[1], path);
 }
 
-/************************************************************************/
-
-static int do_set_rts(char *args, int extra)
+/* Dump a ring log in order */
+static int tool_extract(int argc, char *argv[])
 {
-    int flags;
-    char *space;
+    struct ring_header hdr;
+    struct ring_header *ring;
+    uint64_t head, len, o, k;
+    const char *data, *p;
+    int fd;
 
-    if (!*args || *args == '?')
+    if (argc != 2 || argv[1][0] == '-')
     {
-	printf("Usage: set rts on/off\n");
+	fprintf(stderr, "Usage: tt extract <ring log>\n");
 	return 0;
     }
 
-    space = args;
-    while (*space && !isspace(*space))
-	++space;
-
-    if (term_fd == -1)
+    if ((fd = open(argv[1], O_RDONLY)) == -1)
     {
-	printf("No port selected\n");
+	fprintf(stderr, "failed to open \"%s\": %s\n", argv[1], strerror(errno));
 	return 0;
     }
-
-    if (ioctl(term_fd, TIOCMGET, &flags) == -1) {
-	perror("TIOCMGET");
+    if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)
+	|| memcmp(hdr.magic, RING_MAGIC, sizeof(hdr.magic)) != 0
+	|| hdr.size == 0)
+    {
+	fprintf(stderr, "\"%s\" is not a ring log\n", argv[1]);
 	return 0;
     }
-
-    if (space-args > 1 && strncasecmp(args, "on", space-args) == 0)
-	flags |= TIOCM_RTS;
-    else if (space-args > 1 && strncasecmp(args, "off", space-args) == 0)
-	flags &= ~TIOCM_RTS;
-    else
+    if (!ring_fits(fd, hdr.size))
     {
-	fprintf(stderr, "Invalid parameter, try \"set rts ?\" for help\n");
+	fprintf(stderr, "\"%s\" is truncated\n", argv[1]);
+	return 0;
+    }
+    if ((ring = ring_map(fd, hdr.size, PROT_READ)) == NULL)
+    {
+	perror("mmap");
 	return 0;
     }
 
-    if (ioctl(term_fd, TIOCMSET, &flags) == -1) {
-	perror("TIOCMSET");
+    data = (const char *)ring + RING_DATA;
+    head = ring->head;
+    len = head < ring->size ? head : ring->size;
+    o = (head - len) % ring->size;
+
+    /* once the ring has wrapped the oldest line is likely to be cut,
+       start at the next one */
+    if (head > ring->size)
+    {
+	k = ring->size - o;
+	if ((p = memchr(data + o, '\n', k)) != NULL)
+	    k = p - (data + o) + 1;
+	else if ((p = memchr(data, '\n', o)) != NULL)
+	    k += p - data + 1;
+	o = (o + k) % ring->size;
+	len -= k;
+    }
+
+    k = len < ring->size - o ? len : ring->size - o;
+    if (write_all(1, data + o, k) == -1 || write_all(1, data, len - k) == -1)
+    {
+	perror("write");
 	return 0;
     }
 
@@ -849,316 +7381,777 @@ static int do_set_rts(char *args, int extra)
 
 /************************************************************************/
 
-static int do_set_dtr(char *args, int extra)
+/* tt compare: diff a log against a golden one.  Line hashes are
+   turned into small ids, then the diff works like patience diff:
+   common lines at both ends are matched, lines that occur exactly
+   once on each side are matched where they are in the same order
+   (the longest increasing subsequence), and the stretches between
+   them are diffed the same way.  A stretch without unique lines is
+   split at the common line that occurs least often, as histogram diff
+   does, which keeps repetitive boot logs fast. */
+
+#define CMP_HIST_MAX	64	/* lines more common than this are not anchors */
+#define CMP_DIFF_WINDOW	4096
+
+struct cmp_range
 {
-    int flags;
-    char *space;
+    long a0, a1, b0, b1;
+    int windowed;		/* look for anchors near the start only */
+};
 
-    if (!*args || *args == '?')
+struct cmp_match
+{
+    long a, b;
+};
+
+/* Number the distinct hashes of both files */
+static long cmp_ids(struct cmp_file *a, struct cmp_file *b, int *ida, int *idb)
+{
+    uint64_t *keys;
+    int *vals;
+    unsigned long size, mask, j;
+    long nids = 0, i, k;
+    struct cmp_file *f;
+    int *ids;
+
+    for (size = 16; size < 2 * (a->n + b->n); size *= 2)
+	;
+    mask = size - 1;
+    keys = malloc(size * sizeof(*keys));
+    vals = calloc(size, sizeof(*vals));
+    if (!keys || !vals)
     {
-	printf("Usage: set dtr on/off\n");
-	return 0;
+	perror("malloc");
+	exit(1);
     }
 
-    space = args;
-    while (*space && !isspace(*space))
-	++space;
-
-    if (term_fd == -1)
+    for (k = 0; k < 2; k++)
     {
-	printf("No port selected\n");
-	return 0;
+	f = k ? b : a;
+	ids = k ? idb : ida;
+	for (i = 0; i < f->n; i++)
+	{
+	    for (j = f->hash[i] & mask; vals[j] && keys[j] != f->hash[i]; j = (j + 1) & mask)
+		;
+	    if (!vals[j])
+	    {
+		keys[j] = f->hash[i];
+		vals[j] = ++nids;
+	    }
+	    ids[i] = vals[j] - 1;
+	}
     }
 
-    if (ioctl(term_fd, TIOCMGET, &flags) == -1) {
-	perror("TIOCMGET");
-	return 0;
-    }
+    free(keys);
+    free(vals);
+    return nids;
+}
 
-    if (space-args > 1 && strncasecmp(args, "on", space-args) == 0)
-	flags |= TIOCM_DTR;
-    else if (space-args > 1 && strncasecmp(args, "off", space-args) == 0)
-	flags &= ~TIOCM_DTR;
-    else
+static int cmp_match_order(const void *x, const void *y)
+{
+    const struct cmp_match *p = x, *q = y;
+
+    return p->a < q->a ? -1 : p->a > q->a;
+}
+
+/* Returns the matched lines in order in *out */
+static long cmp_diff(const int *A, long na, const int *B, long nb, long nids,
+		     struct cmp_match **out)
+{
+    struct cmp_range *stack, r;
+    struct cmp_match *m, *pairs;
+    long *tails, *prev, *pos;
+    int *ca, *cb;
+    long nm = 0, sp = 0, stack_size = 64, np, len, lo, hi, mid, i, j, best;
+    long wa1, wb1;
+
+    ca = calloc(nids, sizeof(*ca));
+    cb = calloc(nids, sizeof(*cb));
+    pos = malloc(nids * sizeof(*pos));
+    m = malloc((na < nb ? na : nb) * sizeof(*m) + sizeof(*m));
+    pairs = malloc((na < nb ? na : nb) * sizeof(*pairs) + sizeof(*pairs));
+    tails = malloc((na < nb ? na : nb) * sizeof(*tails) + sizeof(*tails));
+    prev = malloc((na < nb ? na : nb) * sizeof(*prev) + sizeof(*prev));
+    stack = malloc(stack_size * sizeof(*stack));
+    if (!ca || !cb || !pos || !m || !pairs || !tails || !prev || !stack)
     {
-	fprintf(stderr, "Invalid parameter, try \"set dtr ?\" for help\n");
-	return 0;
+	perror("malloc");
+	exit(1);
     }
 
-    if (ioctl(term_fd, TIOCMSET, &flags) == -1) {
-	perror("TIOCMSET");
-	return 0;
-    }
+    stack[sp++] = (struct cmp_range){ 0, na, 0, nb, 0 };
+    while (sp)
+    {
+	r = stack[--sp];
+
+	/* common lines at both ends */
+	while (r.a0 < r.a1 && r.b0 < r.b1 && A[r.a0] == B[r.b0])
+	    m[nm++] = (struct cmp_match){ r.a0++, r.b0++ };
+	while (r.a0 < r.a1 && r.b0 < r.b1 && A[r.a1 - 1] == B[r.b1 - 1])
+	    m[nm++] = (struct cmp_match){ --r.a1, --r.b1 };
+	if (r.a0 == r.a1 || r.b0 == r.b1)
+	    continue;
+
+	/* a very repetitive stretch has no lines that are unique in
+	   all of it, those are looked for near its start instead */
+	wa1 = r.a1;
+	wb1 = r.b1;
+	if (r.windowed)
+	{
+	    if (wa1 > r.a0 + CMP_DIFF_WINDOW)
+		wa1 = r.a0 + CMP_DIFF_WINDOW;
+	    if (wb1 > r.b0 + CMP_DIFF_WINDOW)
+		wb1 = r.b0 + CMP_DIFF_WINDOW;
+	}
 
-    return 1;
-}
+	/* every anchor found can add a stretch */
+	if (sp + (wa1 - r.a0) + 2 > stack_size)
+	{
+	    stack_size = 2 * (sp + (wa1 - r.a0) + 2);
+	    if ((stack = realloc(stack, stack_size * sizeof(*stack))) == NULL)
+	    {
+		perror("realloc");
+		exit(1);
+	    }
+	}
 
-/************************************************************************/
+	for (i = r.a0; i < wa1; i++)
+	{
+	    ca[A[i]]++;
+	    pos[A[i]] = i;
+	}
+	for (i = r.b0; i < wb1; i++)
+	    cb[B[i]]++;
+
+	/* lines unique on both sides, in the order of B */
+	np = 0;
+	for (i = r.b0; i < wb1; i++)
+	    if (cb[B[i]] == 1 && ca[B[i]] == 1)
+		pairs[np++] = (struct cmp_match){ pos[B[i]], i };
+
+	/* failing that, the least common line that both sides have */
+	best = -1;
+	if (np == 0)
+	{
+	    for (i = r.a0; i < wa1; i++)
+		if (cb[A[i]] && (best == -1 || ca[A[i]] < ca[A[best]]))
+		    best = i;
+	    if (best != -1 && ca[A[best]] > CMP_HIST_MAX)
+		best = -1;
+	}
 
-static int do_set_speed(char *args, int extra)
-{
-    struct termios termios;
-    long speed;
-    int speedcode;
-    char *p;
+	for (i = r.a0; i < wa1; i++)
+	    ca[A[i]] = 0;
+	for (i = r.b0; i < wb1; i++)
+	    cb[B[i]] = 0;
 
-    if (!*args || *args == '?')
-    {
-	struct speed *sp;
-	printf("Usage: set speed <speed>\n"
-	       "Where speed is one of: ");
-	for (sp = speedtab; sp->speed != 0; ++sp)
+	if (np)
 	{
-	    if (sp != speedtab)
-		putchar(',');
-	    if ((sp - speedtab) % 10 == 0)
-		printf("\n    ");
-	    else
-		putchar(' ');
-	    printf("%ld", sp->speed);
+	    /* the longest run of them that is in order in A too */
+	    for (len = i = 0; i < np; i++)
+	    {
+		for (lo = 0, hi = len; lo < hi; )
+		{
+		    mid = (lo + hi) / 2;
+		    if (pairs[tails[mid]].a < pairs[i].a)
+			lo = mid + 1;
+		    else
+			hi = mid;
+		}
+		prev[i] = lo ? tails[lo - 1] : -1;
+		tails[lo] = i;
+		if (lo == len)
+		    len++;
+	    }
+
+	    /* split at the anchors, last first */
+	    for (i = tails[len - 1]; i != -1; i = prev[i])
+	    {
+		m[nm++] = pairs[i];
+		stack[sp++] = (struct cmp_range){ pairs[i].a + 1, r.a1,
+						  pairs[i].b + 1, r.b1, r.windowed };
+		r.a1 = pairs[i].a;
+		r.b1 = pairs[i].b;
+		r.windowed = 0;
+	    }
+	    stack[sp++] = r;
+	}
+	else if (best != -1)
+	{
+	    for (j = r.b0; B[j] != A[best]; j++)
+		;
+	    for (i = best; i > r.a0 && j > r.b0 && A[i - 1] == B[j - 1]; i--, j--)
+		;
+	    stack[sp++] = (struct cmp_range){ r.a0, i, r.b0, j, 0 };
+	    for (; i < r.a1 && j < r.b1 && A[i] == B[j]; i++, j++)
+		m[nm++] = (struct cmp_match){ i, j };
+	    stack[sp++] = (struct cmp_range){ i, r.a1, j, r.b1, r.windowed };
+	}
+	else if (!r.windowed && (r.a1 - r.a0 > CMP_DIFF_WINDOW
+				 || r.b1 - r.b0 > CMP_DIFF_WINDOW))
+	{
+	    r.windowed = 1;
+	    stack[sp++] = r;
 	}
-	putchar('\n');
-	return 0;
     }
 
-    speed = strtol(args, &p, 10);
-    while (*p && isspace(*p))
-	++p;
+    qsort(m, nm, sizeof(*m), cmp_match_order);
 
-    if (*p || (speedcode = speed_to_code(speed)) == -1)
+    free(ca);
+    free(cb);
+    free(pos);
+    free(pairs);
+    free(tails);
+    free(prev);
+    free(stack);
+
+    *out = m;
+    return nm;
+}
+
+static int tool_compare(int argc, char *argv[])
+{
+    struct cmp_file *a, *b;
+    struct cmp_match *m, *ch;
+    long nm, nch, nids, i, j, k, ia, ib, end_a, deleted = 0, inserted = 0, hunks = 0;
+    int *ida, *idb;
+    long context = 3;
+    int quiet = 0, c;
+    long long start = now_us();
+
+    while ((c = getopt(argc, argv, "m:nc:q")) != -1)
     {
-	fprintf(stderr, "Invalid parameter, try \"set speed ?\" for help\n");
-	return 0;
+	switch (c)
+	{
+	case 'm':
+	    if (cmp_add_mask(optarg) == -1)
+		return 0;
+	    break;
+	case 'n':
+	    cmp_defaults = 0;
+	    break;
+	case 'c':
+	    context = opt_count(optarg);
+	    break;
+	case 'q':
+	    quiet = 1;
+	    break;
+	default:
+	    optind = argc;
+	    break;
+	}
     }
 
-    if (term_fd == -1)
+    if (argc - optind != 2 || context < 0)
     {
-	printf("No port selected\n");
+	fprintf(stderr,
+		"Usage: tt compare [-m <regex>]... [-n] [-c <lines>] [-q] <golden> <log>\n"
+		"Shows where the log differs from the golden one, after masking\n"
+		"timestamps, addresses and what each -m expression matches.\n"
+		"-n turns the built in masks off, -c sets the lines of context\n"
+		"and -q only prints the summary\n");
 	return 0;
     }
 
-    if (tcgetattr(term_fd, &termios) == -1)
+    /* beyond this the hunk arithmetic would overflow, and it shows
+       every line anyway */
+    if (context > LONG_MAX / 4)
+	context = LONG_MAX / 4;
+
+    if ((a = cmp_load(argv[optind])) == NULL || (b = cmp_load(argv[optind + 1])) == NULL)
+	return 0;
+
+    ida = malloc(a->n * sizeof(*ida) + sizeof(*ida));
+    idb = malloc(b->n * sizeof(*idb) + sizeof(*idb));
+    if (!ida || !idb)
     {
-	perror("tcgetattr");
+	perror("malloc");
 	return 0;
     }
+    nids = cmp_ids(a, b, ida, idb);
+    nm = cmp_diff(ida, a->n, idb, b->n, nids, &m);
 
-    cfsetospeed(&termios, speedcode);
-    cfsetispeed(&termios, speedcode);
+    /* the stretches between matched lines are the changes */
+    ch = malloc((nm + 1) * sizeof(*ch) * 2);
+    for (nch = 0, i = 0, ia = ib = 0; i <= nm; i++)
+    {
+	long ma = i < nm ? m[i].a : a->n;
+	long mb = i < nm ? m[i].b : b->n;
+
+	if (ma > ia || mb > ib)
+	{
+	    ch[2 * nch] = (struct cmp_match){ ia, ib };
+	    ch[2 * nch + 1] = (struct cmp_match){ ma, mb };
+	    nch++;
+	    deleted += ma - ia;
+	    inserted += mb - ib;
+	}
+	ia = ma + 1;
+	ib = mb + 1;
+    }
 
-    if (tcsetattr(term_fd, TCSANOW, &termios) == -1)
+    if (!quiet && nch)
+	printf("--- %s\n+++ %s\n", a->name, b->name);
+    for (i = 0; i < nch; i = j + 1)
     {
-	perror("tcsetattr");
-	return 0;
+	/* changes close enough together share a hunk */
+	for (j = i; j + 1 < nch && ch[2 * (j + 1)].a - ch[2 * j + 1].a <= 2 * context; j++)
+	    ;
+	hunks++;
+	if (quiet)
+	    continue;
+
+	k = ch[2 * i].a < context ? ch[2 * i].a : context;
+	ia = ch[2 * i].a - k;
+	ib = ch[2 * i].b - k;
+	printf("@@ golden line %ld, log line %ld @@\n",
+	       ia < a->n ? a->lineno[ia] : a->n ? a->lineno[a->n - 1] + 1 : 1,
+	       ib < b->n ? b->lineno[ib] : b->n ? b->lineno[b->n - 1] + 1 : 1);
+
+	for (k = i; k <= j; k++)
+	{
+	    for (; ia < ch[2 * k].a; ia++, ib++)
+		cmp_print(stdout, " ", b, ib);
+	    for (; ia < ch[2 * k + 1].a; ia++)
+		cmp_print(stdout, "-", a, ia);
+	    for (; ib < ch[2 * k + 1].b; ib++)
+		cmp_print(stdout, "+", b, ib);
+	}
+	end_a = ia + context < a->n ? ia + context : a->n;
+	for (; ia < end_a && ib < b->n; ia++, ib++)
+	    cmp_print(stdout, " ", b, ib);
     }
 
-    return 1;
+    fflush(stdout);
+    fprintf(stderr, "%ld of %ld golden lines matched, %ld missing, %ld new, "
+	    "%ld hunks, %.2f s\n", nm, a->n, deleted, inserted, hunks,
+	    (now_us() - start) / 1e6);
+
+    free(ch);
+    free(m);
+    free(ida);
+    free(idb);
+    cmp_free(a);
+    cmp_free(b);
+
+    return nch == 0;
 }
 
 /************************************************************************/
 
-static int do_shell(char *args, int extra)
-{
-    if (*args)
-	return system(args) == 0;
-    else
-	return system(getenv("SHELL")) == 0;
-}
+/* Fleet mode: run a script against many ports at once.  tt keeps the
+   state of a single port in globals, so every port gets a tt process
+   of its own, forked from here, which selects the port, opens a log
+   for it and runs the script the same way "tt <script>" would.  This
+   process only watches over them: it collects their output, enforces
+   the time limit and prints a summary when all are done. */
 
-/************************************************************************/
+#define FLEET_TAIL	512
 
-static int do_show(char *args, int extra)
+enum { FLEET_WAITING, FLEET_RUNNING, FLEET_DONE };
+
+struct fleet_port
 {
-    struct termios termios;
-    long speed;
+    const char *port;
+    char *name;			/* names its files in the -o directory */
+    int state;
+    pid_t pid;
+    int fd;			/* output of the child */
+    int out;			/* copy of the output */
+    int status;
+    int timed_out;
+    long long start_us, end_us;
+    char tail[FLEET_TAIL + 1];	/* the end of the output */
+    int tail_len;
+};
 
-    printf("global settings:\n");
-    printf("    break-duration: %d (1/10 seconds)\n", break_duration);
-    printf("    escape-char: %d\n", escape_char);
-    printf("\n");
+static void fleet_child(struct fleet_port *fp, const char *name,
+			const char *dir, int out_fd)
+{
+    char s[FILENAME_MAX + 32];
+    int fd, ok;
 
-    printf("port settings:\n");
-    if (term_fd == -1)
-	printf("    no port selected\n");
-    else
+    if ((fd = open("/dev/null", O_RDONLY)) != -1)
     {
-	if (tcgetattr(term_fd, &termios) == -1)
-	{
-	    perror("tcgetattr");
-	    return 0;
-	}
-
-	speed = code_to_speed(cfgetispeed(&termios));
-	if (speed == -1)
-	    printf("    speed:  unknown\n");
-	else
-	    printf("    speed:  %ld\n", speed);
-
-	if (termios.c_cflag & CRTSCTS)
-	    printf("    flow:   rtscts\n");
-	else
-	    printf("    flow:   none\n");
+	dup2(fd, 0);
+	close(fd);
+    }
+    dup2(out_fd, 1);
+    dup2(out_fd, 2);
+    close(out_fd);
+    setvbuf(stdout, NULL, _IOLBF, 0);
 
-	if (termios.c_cflag & CLOCAL)
-	    printf("    modem:  off\n");
-	else
-	    printf("    modem:  on\n");
+    snprintf(s, sizeof(s), "set port %s", fp->port);
+    if (!handle(s))
+	exit(1);
+    if (dir)
+    {
+	snprintf(s, sizeof(s), "log overwrite %s/%s.log", dir, fp->name);
+	if (!handle(s))
+	    exit(1);
     }
-    printf("\n");
 
-    return 1;
+    ok = script(name);
+    cap_done();
+    log_close();
+    exit(!ok);
 }
 
-/************************************************************************/
-
-struct command
+static int fleet_start(struct fleet_port *fp, const char *name, const char *dir)
 {
-    const char *name;
-    int (*func)(char *args, int extra);
-    const char *help;
-};
+    char fn[FILENAME_MAX];
+    int pipe_fd[2];
 
-static struct command commands[] =
-{
-    { "connect",	do_connect,	"connect" },
-    { "help",		do_help,	"help or ?" },
-    { "log",		do_log,		"log overwrite|append|stop [filename]" },
-    { "quit",		do_quit,	"quit" },
-    { "set ?",		do_set_help,	NULL },
-    { "set break",	do_set_break,	"set break <duration>" },
-    { "set escape",	do_set_escape,	"set escape <character>" },
-    { "set flow",	do_set_flow,	"set flow rtscts|none" },
-    { "set hex",	do_set_hex,	"set hex on|off" },
-    { "set modem",	do_set_modem,	"set modem on|off" },
-    { "set nlcr",	do_set_nlcr,	"set speed on|off" },
-    { "set port",	do_set_port,	"set port <device>" },
-    { "set rts",	do_set_rts,	"set rts on|off" },
-    { "set dtr",	do_set_dtr,	"set dtr on|off" },
-    { "set speed",	do_set_speed,	"set speed <speed>" },
-    { "shell",		do_shell,	"shell [command] or ![command]" },
-    { "show",		do_show,	"show" },
+    if (pipe(pipe_fd) == -1)
+    {
+	perror("pipe");
+	return -1;
+    }
 
-    { NULL },
-};
+    fflush(stdout);
+    fp->start_us = now_us();
+    if ((fp->pid = fork()) == -1)
+    {
+	perror("fork");
+	close(pipe_fd[0]);
+	close(pipe_fd[1]);
+	return -1;
+    }
+    if (fp->pid == 0)
+    {
+	close(pipe_fd[0]);
+	fleet_child(fp, name, dir, pipe_fd[1]);
+    }
 
-static int do_help(char *args, int extra)
-{
-    struct command *cmd;
-    char *dummy;
+    close(pipe_fd[1]);
+    fcntl(pipe_fd[0], F_SETFL, O_NONBLOCK);
+    fcntl(pipe_fd[0], F_SETFD, FD_CLOEXEC);
+    fp->fd = pipe_fd[0];
+    fp->out = -1;
+    if (dir)
+    {
+	snprintf(fn, sizeof(fn), "%s/%s.out", dir, fp->name);
+	if ((fp->out = open(fn, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0666)) == -1)
+	    fprintf(stderr, "failed to open \"%s\": %s\n", fn, strerror(errno));
+    }
+    fp->state = FLEET_RUNNING;
 
-    for (cmd = commands; cmd->name; cmd++)
-	if (fuzzy(cmd->name, args, &dummy) && cmd->help)
-	    printf("    %s\n", cmd->help);
-    printf("\n");
     return 0;
 }
 
-static int do_set_help(char *args, int extra)
+/* Read what the child has written, returns -1 at the end */
+static int fleet_read(struct fleet_port *fp)
 {
-    struct command *cmd;
-    char *dummy;
+    char buf[4096];
+    int n, k;
+
+    while ((n = read(fp->fd, buf, sizeof(buf))) > 0)
+    {
+	if (fp->out != -1)
+	    write_all(fp->out, buf, n);
+
+	k = n < FLEET_TAIL ? n : FLEET_TAIL;
+	if (fp->tail_len + k > FLEET_TAIL)
+	{
+	    memmove(fp->tail, fp->tail + fp->tail_len + k - FLEET_TAIL,
+		    FLEET_TAIL - k);
+	    fp->tail_len = FLEET_TAIL - k;
+	}
+	memcpy(fp->tail + fp->tail_len, buf + n - k, k);
+	fp->tail_len += k;
+    }
+
+    if (n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR))
+    {
+	close(fp->fd);
+	fp->fd = -1;
+	if (fp->out != -1)
+	    close(fp->out);
+	fp->out = -1;
+	return -1;
+    }
 
-    for (cmd = commands; cmd->name; cmd++)
-	if (fuzzy(cmd->name, "set", &dummy) && cmd->help)
-	    printf("    %s\n", cmd->help);
-    printf("\n");
     return 0;
 }
 
-static int handle(char *s)
+/* The last line of output, to show why a port failed */
+static const char *fleet_last_line(struct fleet_port *fp)
 {
+    char *end = fp->tail + fp->tail_len;
     char *p;
-    struct command *cmd;
-    struct command *match;
-    char *args;
-
-    /* strip whitespace on the left */
-    while (*s && isspace(*s))
-	s++;
-
-    /* strip whitespace on the right */
-    p = s + strlen(s) - 1;
-    while (p > s && isspace(*p))
-	*p-- = '\0';
 
-    /* no command */
-    if (!*s)
-	return 1;
+    while (end > fp->tail && isspace((unsigned char)end[-1]))
+	end--;
+    *end = '\0';
+    for (p = end; p > fp->tail && p[-1] != '\n'; p--)
+	;
+    return p;
+}
 
-    /* special commands */
-    if (*s == '?')
-	return do_help(s+1, 0);
+static const char *fleet_base(const char *port)
+{
+    return strrchr(port, '/') ? strrchr(port, '/') + 1 : port;
+}
 
-    if (*s == '!')
-	return do_shell(s+1, 0);
+/* Name the files of each port after the last part of the port name,
+   or after the whole of it where two ports end the same */
+static int fleet_names(struct fleet_port *ports, int n)
+{
+    const char *port;
+    char *p;
+    int i, j;
 
-    match = NULL;
-    args = NULL;
-    for (cmd = commands; cmd->name; cmd++)
+    for (i = 0; i < n; i++)
     {
-	if (fuzzy(cmd->name, s, &args))
+	for (j = 0; j < n; j++)
+	    if (j != i && strcmp(fleet_base(ports[i].port),
+				 fleet_base(ports[j].port)) == 0)
+		break;
+	port = ports[i].port;
+	if ((ports[i].name = strdup(j < n ? port + (*port == '/')
+				    : fleet_base(port))) == NULL)
 	{
-	    if (match)
-	    {
-		/* already have a match, so this is ambiguous */
-		printf("ambiguous command, the following commands match:\n");
-		for (cmd = commands; cmd->name; cmd++)
-		    if (fuzzy(cmd->name, s, &args) && cmd->help)
-			printf("    %s\n", cmd->help);
-		printf("\n");
-		return 0;
-	    }
-	    match = cmd;
+	    perror("strdup");
+	    return -1;
 	}
+	if (j < n)
+	    for (p = ports[i].name; (p = strchr(p, '/')) != NULL; )
+		*p = '_';
     }
 
-    if (match)
-	return match->func(args, 0);
-
-    printf("unknown command '%s'\n", s);
+    for (i = 0; i < n; i++)
+	for (j = 0; j < i; j++)
+	{
+	    if (strcmp(ports[i].port, ports[j].port) == 0)
+	    {
+		fprintf(stderr, "\"%s\" is given more than once\n", ports[i].port);
+		return -1;
+	    }
+	    if (strcmp(ports[i].name, ports[j].name) == 0)
+	    {
+		fprintf(stderr, "\"%s\" and \"%s\" would share the name \"%s\"\n",
+			ports[j].port, ports[i].port, ports[i].name);
+		return -1;
+	    }
+	}
 
     return 0;
 }
 
-static int script(const char *name)
+static int tool_fleet(int argc, char *argv[])
 {
-    FILE *fp;
-    char fn[FILENAME_MAX];
-    char s[256];
-    int line;
+    struct fleet_port *ports, *fp;
+    const char *dir = NULL;
+    long jobs = 0, timeout = 0;
+    long long start, now;
+    int n, i, c, running, done, passed;
+    struct timeval tv;
+    fd_set readfds;
+    int fd_limit;
+    glob_t g;
+    pid_t pid;
+    int status;
 
-    snprintf(fn, sizeof(fn)-1, "%s/.tt/%s", getenv("HOME"), name);
-    fn[sizeof(fn)-1] = '\0';
+    while ((c = getopt(argc, argv, "j:t:o:")) != -1)
+    {
+	switch (c)
+	{
+	case 'j':
+	    jobs = opt_count(optarg);
+	    break;
+	case 't':
+	    timeout = opt_count(optarg);
+	    break;
+	case 'o':
+	    dir = optarg;
+	    break;
+	default:
+	    optind = argc;
+	    break;
+	}
+    }
 
-    if ((fp = fopen(fn, "r")) == NULL)
+    if (argc - optind < 2 || jobs < 0 || timeout < 0)
     {
-	fprintf(stderr, "could not run script \"%s\": %s\n",
-		fn, strerror(errno));
+	fprintf(stderr,
+		"Usage: tt fleet [-j <jobs>] [-t <seconds>] [-o <dir>] <script> <port>...\n"
+		"Runs the script against every port at once, at most <jobs> at a\n"
+		"time and each for at most <seconds>.  Ports may be glob patterns.\n"
+		"With -o each port gets <dir>/<port>.log and its output in\n"
+		"<dir>/<port>.out, <port> being the whole path where the last\n"
+		"part is not unique\n");
 	return 0;
     }
 
-    fprintf(stderr, "Running script \"%s\"\n", fn);
+    memset(&g, 0, sizeof(g));
+    for (i = optind + 1; i < argc; i++)
+	if (glob(argv[i], GLOB_NOCHECK | (i > optind + 1 ? GLOB_APPEND : 0),
+		 NULL, &g) != 0)
+	{
+	    fprintf(stderr, "failed to expand \"%s\"\n", argv[i]);
+	    return 0;
+	}
 
-    line = 0;
-    while (fgets(s, sizeof(s), fp) != NULL)
+    n = g.gl_pathc;
+    if ((ports = calloc(n, sizeof(*ports))) == NULL)
     {
-	line++;
-	fputs(s, stdout);
-	if (!handle(s))
+	perror("calloc");
+	return 0;
+    }
+    for (i = 0; i < n; i++)
+    {
+	ports[i].port = g.gl_pathv[i];
+	ports[i].fd = ports[i].out = -1;
+    }
+    if (fleet_names(ports, n) == -1)
+    {
+	for (i = 0; i < n; i++)
+	    free(ports[i].name);
+	free(ports);
+	globfree(&g);
+	return 0;
+    }
+    if (jobs <= 0 || jobs > n)
+	jobs = n;
+
+    start = now_us();
+    running = done = 0;
+    while (done < n)
+    {
+	for (fp = ports; running < jobs && fp < ports + n; fp++)
 	{
-	    fprintf(stderr, "%s: error at line %d, aborting script\n", name, line);
-	    fclose(fp);
+	    if (fp->state != FLEET_WAITING)
+		continue;
+	    if (fleet_start(fp, argv[optind], dir) == -1)
+	    {
+		fp->state = FLEET_DONE;
+		fp->status = -1;
+		done++;
+		continue;
+	    }
+	    running++;
+	}
+
+	FD_ZERO(&readfds);
+	fd_limit = 0;
+	for (fp = ports; fp < ports + n; fp++)
+	    if (fp->fd != -1)
+		fd_watch(fp->fd, &readfds, &fd_limit);
+
+	tv.tv_sec = 0;
+	tv.tv_usec = 100000;
+	if (select(fd_limit, &readfds, NULL, NULL, &tv) < 0 && errno != EINTR)
+	{
+	    perror("select");
 	    return 0;
 	}
+
+	for (fp = ports; fp < ports + n; fp++)
+	    if (fp->fd != -1 && FD_ISSET(fp->fd, &readfds))
+		fleet_read(fp);
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+	{
+	    for (fp = ports; fp < ports + n && fp->pid != pid; fp++)
+		;
+	    if (fp == ports + n)
+		continue;
+
+	    /* a shell started by the script may still hold the pipe,
+	       take what is there and stop listening */
+	    if (fp->fd != -1 && fleet_read(fp) == 0)
+	    {
+		close(fp->fd);
+		fp->fd = -1;
+		if (fp->out != -1)
+		    close(fp->out);
+		fp->out = -1;
+	    }
+	    fp->status = status;
+	    fp->end_us = now_us();
+	    fp->state = FLEET_DONE;
+	    running--;
+	    done++;
+	}
+
+	if (timeout)
+	{
+	    now = now_us();
+	    for (fp = ports; fp < ports + n; fp++)
+		if (fp->state == FLEET_RUNNING && !fp->timed_out
+		    && now - fp->start_us > timeout * 1000000LL)
+		{
+		    kill(fp->pid, SIGKILL);
+		    fp->timed_out = 1;
+		}
+	}
     }
 
-    fclose(fp);
+    passed = 0;
+    printf("%-24s %-8s %8s\n", "port", "result", "seconds");
+    for (fp = ports; fp < ports + n; fp++)
+    {
+	const char *result;
+	char sig[32];
+
+	if (fp->status == -1)
+	    result = "error";
+	else if (fp->timed_out)
+	    result = "timeout";
+	else if (WIFSIGNALED(fp->status))
+	{
+	    snprintf(sig, sizeof(sig), "signal %d", WTERMSIG(fp->status));
+	    result = sig;
+	}
+	else if (WEXITSTATUS(fp->status) == 0)
+	{
+	    result = "pass";
+	    passed++;
+	}
+	else
+	    result = "FAIL";
 
-    return 1;
+	printf("%-24s %-8s %8.2f", fp->port, result,
+	       fp->status == -1 ? 0 : (fp->end_us - fp->start_us) / 1e6);
+	if (strcmp(result, "pass") != 0 && *fleet_last_line(fp))
+	    printf("  %s", fleet_last_line(fp));
+	printf("\n");
+    }
+    printf("%d of %d passed in %.2f seconds\n", passed, n,
+	   (now_us() - start) / 1e6);
+
+    for (i = 0; i < n; i++)
+	free(ports[i].name);
+    globfree(&g);
+    free(ports);
+
+    return passed == n;
 }
 
+/************************************************************************/
+
+struct tool
+{
+    const char *name;
+    int (*func)(int argc, char *argv[]);
+};
+
+static struct tool tools[] =
+{
+    { "attach",		tool_attach },
+    { "ctl",		tool_ctl },
+    { "compare",	tool_compare },
+    { "extract",	tool_extract },
+    { "fleet",		tool_fleet },
+    { "merge",		tool_merge },
+    { "replay",		tool_replay },
+
+    { NULL },
+};
+
 int main(int argc, char *argv[])
 {
+    struct tool *tool;
     char s[256];
 
     term_fd = -1;
@@ -1166,9 +8159,21 @@ int main(int argc, char *argv[])
 
     setenv("TT_PORT", "", 1);
 
+    if (argc > 1)
+	for (tool = tools; tool->name; tool++)
+	    if (strcmp(argv[1], tool->name) == 0)
+		exit(!tool->func(argc - 1, argv + 1));
+
     if (argc > 2)
     {
-	printf("Usage: tt [script name]\n");
+	printf("Usage: tt [script name]\n"
+	       "       tt replay [options] <log>\n"
+	       "       tt merge [options] <log>...\n"
+	       "       tt ctl [-d] <socket> <command>...\n"
+	       "       tt attach <session>\n"
+	       "       tt compare [options] <golden> <log>\n"
+	       "       tt extract <ring log>\n"
+	       "       tt fleet [options] <script> <port>...\n");
 	exit(1);
     }
 